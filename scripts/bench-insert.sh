@@ -0,0 +1,128 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Insert contention benchmark for xt_bpflimit.
+#
+# pktgen sends UDP from FLOWS random source addresses over a veth pair
+# into a netns, from each of a list of cpu counts in turn.  There a
+# bpflimit rule in the raw table keys on the source, so with many flows
+# nearly every packet is a table miss and an insert.  The result is a
+# table of the rate at which packets got through netfilter, one row per
+# cpu count, with a fresh table for each.  Run it on each build to
+# compare, e.g.
+#
+#   ./bench-insert.sh -c 1,2,4,8
+#
+# Needs root, pktgen, an iptables that finds libxt_bpflimit, and the
+# module loaded.  Extra match options go in -o, e.g. -o --bpflimit-gcra.
+
+set -e
+
+CPUS=1,2,4
+FLOWS=1000000
+COUNT=2000000
+OPTS=
+
+usage() {
+	echo "usage: $0 [-c cpus,...] [-n flows] [-p packets per cpu] [-o match options]" >&2
+	exit 1
+}
+
+while getopts c:n:p:o: opt; do
+	case $opt in
+	c) CPUS=$OPTARG ;;
+	n) FLOWS=$OPTARG ;;
+	p) COUNT=$OPTARG ;;
+	o) OPTS=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+NS=bpfbench
+PG=/proc/net/pktgen
+
+pg() {
+	echo "$2" > "$1"
+}
+
+ip4() {
+	echo "$(($1 >> 24 & 255)).$(($1 >> 16 & 255)).$(($1 >> 8 & 255)).$(($1 & 255))"
+}
+
+cleanup() {
+	for t in $PG/kpktgend_*; do
+		pg "$t" rem_device_all 2>/dev/null || true
+	done
+	ip netns del $NS 2>/dev/null || true
+}
+trap cleanup EXIT
+
+modprobe pktgen
+cleanup
+
+ip netns add $NS
+ip link add bb0 type veth peer name bb1
+ip link set bb1 netns $NS
+ip link set bb0 up
+ip -n $NS link set bb1 up
+ip -n $NS addr add 198.18.0.1/15 dev bb1
+MAC=$(ip netns exec $NS cat /sys/class/net/bb1/address)
+
+# sources from 10.0.0.1 on
+SRC_MIN=$((10 << 24 | 1))
+SRC_MAX=$((SRC_MIN + FLOWS - 1))
+
+# one measurement on $1 cpus, into an empty table
+run() {
+	cpus=$1
+
+	# the first rule only counts what reached netfilter
+	ip netns exec $NS iptables -t raw -F PREROUTING
+	ip netns exec $NS iptables -t raw -A PREROUTING -i bb1
+	ip netns exec $NS iptables -t raw -A PREROUTING -i bb1 -m bpflimit \
+		--bpflimit-upto 10/sec --bpflimit-mode srcip \
+		--bpflimit-name bench --bpflimit-htable-max $((FLOWS * 2)) \
+		$OPTS -j DROP
+
+	for t in $PG/kpktgend_*; do
+		pg "$t" rem_device_all
+	done
+	i=0
+	while [ $i -lt "$cpus" ]; do
+		pg $PG/kpktgend_$i "add_device bb0@$i"
+		dev=$PG/bb0@$i
+		pg $dev "count $COUNT"
+		pg $dev "clone_skb 0"
+		pg $dev "pkt_size 64"
+		pg $dev "delay 0"
+		pg $dev "dst 198.18.0.1"
+		pg $dev "dst_mac $MAC"
+		pg $dev "src_min $(ip4 $SRC_MIN)"
+		pg $dev "src_max $(ip4 $SRC_MAX)"
+		pg $dev "flag IPSRC_RND"
+		pg $dev "udp_src_min 9"
+		pg $dev "udp_src_max 9"
+		pg $dev "udp_dst_min 9"
+		pg $dev "udp_dst_max 9"
+		i=$((i + 1))
+	done
+
+	start=$(date +%s%N)
+	pg $PG/pgctrl start
+	end=$(date +%s%N)
+
+	seen=$(ip netns exec $NS iptables -t raw -L PREROUTING -v -x -n |
+	       awk 'NR == 3 { print $1 }')
+	usec=$(((end - start) / 1000))
+
+	echo "| $cpus | $((COUNT * cpus)) | $seen | $((seen * 1000000 / usec)) |"
+}
+
+echo "$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null)," \
+     "$FLOWS flows, $(nproc) cpus online${OPTS:+, $OPTS}"
+echo
+echo "| cpus | sent | seen | pps |"
+echo "|-----:|-----:|-----:|----:|"
+for c in $(echo "$CPUS" | tr , ' '); do
+	run "$c"
+done
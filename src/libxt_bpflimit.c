@@ -13,6 +13,7 @@
 #define _BSD_SOURCE 1
 #define _DEFAULT_SOURCE 1
 #define _ISOC99_SOURCE 1
+#include <ctype.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdbool.h>
@@ -38,6 +39,9 @@
 
 struct bpflimit_mt_udata {
 	uint32_t mult;
+	uint32_t msec;	/* sub-second rate unit, revision 4 */
+	bool parent_bytes;
+	bool global_bytes;
 };
 
 static void bpflimit_help(void)
@@ -73,11 +77,34 @@ enum {
 	O_HTABLE_EXPIRE,
 	O_RATEMATCH,
 	O_INTERVAL,
+	O_BPF,
+	O_GCRA,
+	O_EVICT,
+	O_PREALLOC,
+	O_ADMIT,
+	O_SKETCH,
+	O_PARENT,
+	O_PARENT_BURST,
+	O_PARENT_SRCMASK,
+	O_PARENT_DSTMASK,
+	O_GLOBAL,
+	O_GLOBAL_BURST,
+	O_HTABLE_PROBATION,
+	O_HTABLE_MAXMEM,
+	O_HTABLE_SHRINK,
 	F_BURST         = 1 << O_BURST,
 	F_UPTO          = 1 << O_UPTO,
 	F_ABOVE         = 1 << O_ABOVE,
 	F_HTABLE_EXPIRE = 1 << O_HTABLE_EXPIRE,
 	F_RATEMATCH	= 1 << O_RATEMATCH,
+	F_BPF		= 1 << O_BPF,
+	F_PARENT	= 1 << O_PARENT,
+	F_PARENT_BURST	= 1 << O_PARENT_BURST,
+	F_PARENT_SRCMASK = 1 << O_PARENT_SRCMASK,
+	F_PARENT_DSTMASK = 1 << O_PARENT_DSTMASK,
+	F_GLOBAL	= 1 << O_GLOBAL,
+	F_GLOBAL_BURST	= 1 << O_GLOBAL_BURST,
+	F_HTABLE_PROBATION = 1 << O_HTABLE_PROBATION,
 };
 
 static void bpflimit_mt_help(void)
@@ -124,6 +151,65 @@ static void bpflimit_mt_help_v3(void)
 "\n", XT_BPFLIMIT_BURST);
 }
 
+static void bpflimit_mt_help_v4(void)
+{
+	printf(
+"bpflimit match options:\n"
+"  --bpflimit-upto <avg>           max average match rate\n"
+"                                   [Packets per second unless followed by \n"
+"                                   /sec /minute /hour /day or /[N]ms\n"
+"                                   postfixes, e.g. 10000/10ms]\n"
+"  --bpflimit-above <avg>          min average match rate\n"
+"  --bpflimit-mode <mode>          mode is a comma-separated list of\n"
+"                                   dstip,srcip,dstport,srcport (or none)\n"
+"  --bpflimit-srcmask <length>     source address grouping prefix length\n"
+"  --bpflimit-dstmask <length>     destination address grouping prefix length\n"
+"  --bpflimit-name <name>          name for /proc/net/ipt_bpflimit\n"
+"  --bpflimit-burst <num>	    number to match in a burst, default %u\n"
+"  --bpflimit-htable-size <num>    number of hashtable buckets\n"
+"  --bpflimit-htable-max <num>     number of hashtable entries\n"
+"  --bpflimit-htable-gcinterval    interval between garbage collection runs\n"
+"  --bpflimit-htable-expire        after which time are idle entries expired?\n"
+"  --bpflimit-rate-match           rate match the flow without rate-limiting it\n"
+"  --bpflimit-rate-interval        sliding window for bpflimit-rate-match,\n"
+"                                   seconds or <n>ms\n"
+"  --bpflimit-bpf <path>           pinned eBPF program whose return value\n"
+"                                   is added to the hash key\n"
+"  --bpflimit-gcra                 lockless GCRA limiter (packet rates only)\n"
+"  --bpflimit-htable-evict         when the hashtable is full, evict the\n"
+"                                   oldest entry instead of dropping\n"
+"  --bpflimit-htable-prealloc      reserve memory for htable-max entries\n"
+"                                   when the hashtable is created\n"
+"  --bpflimit-admit <num>          packets a key may send before it gets\n"
+"                                   a hashtable entry (at most the burst)\n"
+"  --bpflimit-sketch               approximate limiter in fixed memory,\n"
+"                                   htable-size counters wide, no entries\n"
+"  --bpflimit-parent <avg>         also limit the aggregate of all keys\n"
+"                                   under the parent masks, same units\n"
+"  --bpflimit-parent-burst <num>   burst of the aggregate\n"
+"  --bpflimit-parent-srcmask <length>\n"
+"  --bpflimit-parent-dstmask <length>\n"
+"                                   prefix lengths of the aggregate,\n"
+"                                   default to the key's\n"
+"  --bpflimit-global <avg>         also limit all keys of the table\n"
+"                                   together, same units\n"
+"  --bpflimit-global-burst <num>   burst of the table-wide limit\n"
+"  --bpflimit-htable-probation     expire time of entries that have seen\n"
+"                                   one packet, ms (default htable-expire)\n"
+"  --bpflimit-htable-maxmem <bytes> memory for entries and buckets\n"
+"  --bpflimit-htable-shrink        give back idle entries under memory\n"
+"                                   pressure\n"
+"\n"
+"Keys of a table are pinned to their own rate by root writing\n"
+"  pin [src=ADDR] [dst=ADDR] [sport=N] [dport=N] [bpf=N] avg=N burst=N\n"
+"  unpin [src=ADDR] [dst=ADDR] [sport=N] [dport=N] [bpf=N]\n"
+"to /proc/net/ipt_bpflimit/<name>.  avg and burst are raw values: avg\n"
+"is nanoseconds between packets and burst a packet count, or bytes per\n"
+"second and bytes for byte rates.  1000/sec burst 5 is avg=1000000 burst=5.\n"
+"Writing flush resets every key but the pinned ones.\n"
+"\n", XT_BPFLIMIT_BURST);
+}
+
 #define s struct xt_bpflimit_info
 static const struct xt_option_entry bpflimit_opts[] = {
 	{.name = "bpflimit", .id = O_UPTO, .excl = F_ABOVE,
@@ -212,6 +298,38 @@ static const struct xt_option_entry bpflimit_mt_opts_v2[] = {
 #undef s
 
 #define s struct xt_bpflimit_mtinfo3
+static const struct xt_option_entry bpflimit_mt_opts_v3[] = {
+	{.name = "bpflimit-upto", .id = O_UPTO, .excl = F_ABOVE,
+	 .type = XTTYPE_STRING, .flags = XTOPT_INVERT},
+	{.name = "bpflimit-above", .id = O_ABOVE, .excl = F_UPTO,
+	 .type = XTTYPE_STRING, .flags = XTOPT_INVERT},
+	{.name = "bpflimit", .id = O_UPTO, .excl = F_ABOVE,
+	 .type = XTTYPE_STRING, .flags = XTOPT_INVERT}, /* old name */
+	{.name = "bpflimit-srcmask", .id = O_SRCMASK, .type = XTTYPE_PLEN},
+	{.name = "bpflimit-dstmask", .id = O_DSTMASK, .type = XTTYPE_PLEN},
+	{.name = "bpflimit-burst", .id = O_BURST, .type = XTTYPE_STRING},
+	{.name = "bpflimit-htable-size", .id = O_HTABLE_SIZE,
+	 .type = XTTYPE_UINT32, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.size)},
+	{.name = "bpflimit-htable-max", .id = O_HTABLE_MAX,
+	 .type = XTTYPE_UINT32, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.max)},
+	{.name = "bpflimit-htable-gcinterval", .id = O_HTABLE_GCINT,
+	 .type = XTTYPE_UINT32, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.gc_interval)},
+	{.name = "bpflimit-htable-expire", .id = O_HTABLE_EXPIRE,
+	 .type = XTTYPE_UINT32, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.expire)},
+	{.name = "bpflimit-mode", .id = O_MODE, .type = XTTYPE_STRING},
+	{.name = "bpflimit-name", .id = O_NAME, .type = XTTYPE_STRING,
+	 .flags = XTOPT_MAND | XTOPT_PUT, XTOPT_POINTER(s, name), .min = 1},
+	{.name = "bpflimit-rate-match", .id = O_RATEMATCH, .type = XTTYPE_NONE},
+	{.name = "bpflimit-rate-interval", .id = O_INTERVAL, .type = XTTYPE_STRING},
+	XTOPT_TABLEEND,
+};
+#undef s
+
+#define s struct xt_bpflimit_mtinfo4
 static const struct xt_option_entry bpflimit_mt_opts[] = {
 	{.name = "bpflimit-upto", .id = O_UPTO, .excl = F_ABOVE,
 	 .type = XTTYPE_STRING, .flags = XTOPT_INVERT},
@@ -239,12 +357,43 @@ static const struct xt_option_entry bpflimit_mt_opts[] = {
 	 .flags = XTOPT_MAND | XTOPT_PUT, XTOPT_POINTER(s, name), .min = 1},
 	{.name = "bpflimit-rate-match", .id = O_RATEMATCH, .type = XTTYPE_NONE},
 	{.name = "bpflimit-rate-interval", .id = O_INTERVAL, .type = XTTYPE_STRING},
+	{.name = "bpflimit-bpf", .id = O_BPF, .type = XTTYPE_STRING,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, bpf_path), .min = 1},
+	{.name = "bpflimit-gcra", .id = O_GCRA, .type = XTTYPE_NONE,
+	 .excl = F_RATEMATCH},
+	{.name = "bpflimit-htable-evict", .id = O_EVICT, .type = XTTYPE_NONE},
+	{.name = "bpflimit-htable-prealloc", .id = O_PREALLOC,
+	 .type = XTTYPE_NONE},
+	{.name = "bpflimit-admit", .id = O_ADMIT, .type = XTTYPE_UINT32,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, cfg.admit), .min = 1,
+	 .excl = F_RATEMATCH},
+	{.name = "bpflimit-sketch", .id = O_SKETCH, .type = XTTYPE_NONE,
+	 .excl = F_RATEMATCH},
+	{.name = "bpflimit-parent", .id = O_PARENT, .type = XTTYPE_STRING,
+	 .excl = F_RATEMATCH},
+	{.name = "bpflimit-parent-burst", .id = O_PARENT_BURST,
+	 .type = XTTYPE_STRING, .also = F_PARENT},
+	{.name = "bpflimit-parent-srcmask", .id = O_PARENT_SRCMASK,
+	 .type = XTTYPE_PLEN, .also = F_PARENT},
+	{.name = "bpflimit-parent-dstmask", .id = O_PARENT_DSTMASK,
+	 .type = XTTYPE_PLEN, .also = F_PARENT},
+	{.name = "bpflimit-global", .id = O_GLOBAL, .type = XTTYPE_STRING},
+	{.name = "bpflimit-global-burst", .id = O_GLOBAL_BURST,
+	 .type = XTTYPE_STRING, .also = F_GLOBAL},
+	{.name = "bpflimit-htable-probation", .id = O_HTABLE_PROBATION,
+	 .type = XTTYPE_UINT32, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.probation), .min = 1},
+	{.name = "bpflimit-htable-maxmem", .id = O_HTABLE_MAXMEM,
+	 .type = XTTYPE_UINT64, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(s, cfg.maxmem), .min = 1},
+	{.name = "bpflimit-htable-shrink", .id = O_HTABLE_SHRINK,
+	 .type = XTTYPE_NONE},
 	XTOPT_TABLEEND,
 };
 #undef s
 
 static int
-cfg_copy(struct bpflimit_cfg3 *to, const void *from, int revision)
+cfg_copy(struct bpflimit_cfg4 *to, const void *from, int revision)
 {
 	if (revision == 1) {
 		struct bpflimit_cfg1 *cfg = (struct bpflimit_cfg1 *)from;
@@ -271,7 +420,20 @@ cfg_copy(struct bpflimit_cfg3 *to, const void *from, int revision)
 		to->srcmask = cfg->srcmask;
 		to->dstmask = cfg->dstmask;
 	} else if (revision == 3) {
-		memcpy(to, from, sizeof(struct bpflimit_cfg3));
+		struct bpflimit_cfg3 *cfg = (struct bpflimit_cfg3 *)from;
+
+		to->mode = cfg->mode;
+		to->avg = cfg->avg;
+		to->burst = cfg->burst;
+		to->size = cfg->size;
+		to->max = cfg->max;
+		to->gc_interval = cfg->gc_interval;
+		to->expire = cfg->expire;
+		to->interval = cfg->interval;
+		to->srcmask = cfg->srcmask;
+		to->dstmask = cfg->dstmask;
+	} else if (revision == 4) {
+		memcpy(to, from, sizeof(struct bpflimit_cfg4));
 	} else {
 		return -EINVAL;
 	}
@@ -361,7 +523,9 @@ static bool parse_bytes(const char *rate, void *val, struct bpflimit_mt_udata *u
 			"Rate value too large \"%"PRIu64"\" (max %"PRIu64")\n",
 					tmp, max);
 
-	tmp = bytes_to_cost(tmp);
+	/* revision 4 takes bytes as they are */
+	if (revision < 4)
+		tmp = bytes_to_cost(tmp);
 	if (tmp == 0)
 		xtables_error(PARAMETER_PROBLEM, "Rate too high \"%s\"\n", rate);
 
@@ -375,20 +539,43 @@ static bool parse_bytes(const char *rate, void *val, struct bpflimit_mt_udata *u
 	return true;
 }
 
+/* "ms" or "<n>ms", up to a day */
+static bool parse_msec(const char *unit, uint32_t *msec)
+{
+	unsigned long n = 1;
+	char *end = (char *)unit;
+
+	if (isdigit((unsigned char)*unit)) {
+		n = strtoul(unit, &end, 10);
+		if (n == 0 || n > 24*60*60*1000UL)
+			return false;
+	}
+	if (strcasecmp(end, "ms") != 0)
+		return false;
+
+	*msec = n;
+	return true;
+}
+
 static
 int parse_rate(const char *rate, void *val, struct bpflimit_mt_udata *ud, int revision)
 {
 	const char *delim;
 	uint64_t tmp, r;
-	uint64_t scale = (revision == 1) ? XT_BPFLIMIT_SCALE : XT_BPFLIMIT_SCALE_v2;
+	uint64_t scale = (revision == 1) ? XT_BPFLIMIT_SCALE :
+			 (revision >= 4) ? XT_BPFLIMIT_SCALE_v4 :
+			 XT_BPFLIMIT_SCALE_v2;
 
 	ud->mult = 1;  /* Seconds by default. */
+	ud->msec = 0;
 	delim = strchr(rate, '/');
 	if (delim) {
 		if (strlen(delim+1) == 0)
 			return 0;
 
-		if (strncasecmp(delim+1, "second", strlen(delim+1)) == 0)
+		if (revision >= 4 && parse_msec(delim+1, &ud->msec))
+			; /* entries still expire after a second */
+		else if (strncasecmp(delim+1, "second", strlen(delim+1)) == 0)
 			ud->mult = 1;
 		else if (strncasecmp(delim+1, "minute", strlen(delim+1)) == 0)
 			ud->mult = 60;
@@ -403,7 +590,10 @@ int parse_rate(const char *rate, void *val, struct bpflimit_mt_udata *ud, int re
 	if (!r)
 		return 0;
 
-	tmp = scale * ud->mult / r;
+	if (ud->msec)
+		tmp = scale / 1000 * ud->msec / r;
+	else
+		tmp = scale * ud->mult / r;
 	if (tmp == 0)
 		/*
 		 * The rate maps to infinity. (1/day is the minimum they can
@@ -429,6 +619,26 @@ static int parse_interval(const char *rate, uint32_t *val)
 	return 1;
 }
 
+/* revision 4 keeps the interval in ms, plain numbers are seconds */
+static int parse_interval_ms(const char *rate, uint32_t *val)
+{
+	unsigned long r;
+	char *end;
+
+	r = strtoul(rate, &end, 10);
+	if (r == 0 || end == rate)
+		return 0;
+	if (*end == '\0' || strcasecmp(end, "s") == 0)
+		r *= 1000;
+	else if (strcasecmp(end, "ms") != 0)
+		return 0;
+	if (r > UINT32_MAX)
+		return 0;
+
+	*val = r;
+	return 1;
+}
+
 #ifndef _init
 #define _init __attribute__((constructor)) _INIT
 #endif
@@ -485,7 +695,7 @@ static void bpflimit_mt6_init_v2(struct xt_entry_match *match)
 	info->cfg.dstmask     = 128;
 }
 
-static void bpflimit_mt4_init(struct xt_entry_match *match)
+static void bpflimit_mt4_init_v3(struct xt_entry_match *match)
 {
 	struct xt_bpflimit_mtinfo3 *info = (void *)match->data;
 
@@ -497,7 +707,7 @@ static void bpflimit_mt4_init(struct xt_entry_match *match)
 	info->cfg.interval    = 0;
 }
 
-static void bpflimit_mt6_init(struct xt_entry_match *match)
+static void bpflimit_mt6_init_v3(struct xt_entry_match *match)
 {
 	struct xt_bpflimit_mtinfo3 *info = (void *)match->data;
 
@@ -509,6 +719,30 @@ static void bpflimit_mt6_init(struct xt_entry_match *match)
 	info->cfg.interval    = 0;
 }
 
+static void bpflimit_mt4_init(struct xt_entry_match *match)
+{
+	struct xt_bpflimit_mtinfo4 *info = (void *)match->data;
+
+	info->cfg.mode        = 0;
+	info->cfg.burst       = XT_BPFLIMIT_BURST;
+	info->cfg.gc_interval = XT_BPFLIMIT_GCINTERVAL;
+	info->cfg.srcmask     = 32;
+	info->cfg.dstmask     = 32;
+	info->cfg.interval    = 0;
+}
+
+static void bpflimit_mt6_init(struct xt_entry_match *match)
+{
+	struct xt_bpflimit_mtinfo4 *info = (void *)match->data;
+
+	info->cfg.mode        = 0;
+	info->cfg.burst       = XT_BPFLIMIT_BURST;
+	info->cfg.gc_interval = XT_BPFLIMIT_GCINTERVAL;
+	info->cfg.srcmask     = 128;
+	info->cfg.dstmask     = 128;
+	info->cfg.interval    = 0;
+}
+
 /* Parse a 'mode' parameter into the required bitmask */
 static int parse_mode(uint32_t *mode, const char *option_arg)
 {
@@ -639,7 +873,7 @@ static void bpflimit_mt_parse_v2(struct xt_option_call *cb)
 	}
 }
 
-static void bpflimit_mt_parse(struct xt_option_call *cb)
+static void bpflimit_mt_parse_v3(struct xt_option_call *cb)
 {
 	struct xt_bpflimit_mtinfo3 *info = cb->data;
 
@@ -687,6 +921,112 @@ static void bpflimit_mt_parse(struct xt_option_call *cb)
 	}
 }
 
+static void bpflimit_mt_parse(struct xt_option_call *cb)
+{
+	struct xt_bpflimit_mtinfo4 *info = cb->data;
+
+	xtables_option_parse(cb);
+	switch (cb->entry->id) {
+	case O_BURST:
+		info->cfg.burst = parse_burst(cb->arg, 2);
+		break;
+	case O_UPTO:
+		if (cb->invert)
+			info->cfg.mode |= XT_BPFLIMIT_INVERT;
+		if (parse_bytes(cb->arg, &info->cfg.avg, cb->udata, 4))
+			info->cfg.mode |= XT_BPFLIMIT_BYTES;
+		else if (!parse_rate(cb->arg, &info->cfg.avg, cb->udata, 4))
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+			          "--bpflimit-upto", cb->arg);
+		break;
+	case O_ABOVE:
+		if (!cb->invert)
+			info->cfg.mode |= XT_BPFLIMIT_INVERT;
+		if (parse_bytes(cb->arg, &info->cfg.avg, cb->udata, 4))
+			info->cfg.mode |= XT_BPFLIMIT_BYTES;
+		else if (!parse_rate(cb->arg, &info->cfg.avg, cb->udata, 4))
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+			          "--bpflimit-above", cb->arg);
+		break;
+	case O_MODE:
+		if (parse_mode(&info->cfg.mode, cb->arg) < 0)
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+			          "--bpflimit-mode", cb->arg);
+		break;
+	case O_SRCMASK:
+		info->cfg.srcmask = cb->val.hlen;
+		break;
+	case O_DSTMASK:
+		info->cfg.dstmask = cb->val.hlen;
+		break;
+	case O_RATEMATCH:
+		info->cfg.mode |= XT_BPFLIMIT_RATE_MATCH;
+		break;
+	case O_INTERVAL:
+		if (!parse_interval_ms(cb->arg, &info->cfg.interval))
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+				"--bpflimit-rate-interval", cb->arg);
+		break;
+	case O_BPF:
+		info->cfg.mode |= XT_BPFLIMIT_HASH_BPF;
+		break;
+	case O_GCRA:
+		info->cfg.mode |= XT_BPFLIMIT_GCRA;
+		break;
+	case O_EVICT:
+		info->cfg.mode |= XT_BPFLIMIT_EVICT;
+		break;
+	case O_PREALLOC:
+		info->cfg.mode |= XT_BPFLIMIT_PREALLOC;
+		break;
+	case O_SKETCH:
+		info->cfg.mode |= XT_BPFLIMIT_SKETCH;
+		break;
+	case O_HTABLE_SHRINK:
+		info->cfg.mode |= XT_BPFLIMIT_SHRINK;
+		break;
+	case O_PARENT: {
+		struct bpflimit_mt_udata *udata = cb->udata;
+		struct bpflimit_mt_udata ud;
+
+		info->cfg.mode |= XT_BPFLIMIT_PARENT;
+		/* the units must match the key's, see bpflimit_mt_check */
+		udata->parent_bytes = parse_bytes(cb->arg,
+						  &info->cfg.parent_avg, &ud, 4);
+		if (!udata->parent_bytes &&
+		    !parse_rate(cb->arg, &info->cfg.parent_avg, &ud, 4))
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+			          "--bpflimit-parent", cb->arg);
+		break;
+	}
+	case O_PARENT_BURST:
+		info->cfg.parent_burst = parse_burst(cb->arg, 2);
+		break;
+	case O_PARENT_SRCMASK:
+		info->cfg.parent_srcmask = cb->val.hlen;
+		break;
+	case O_PARENT_DSTMASK:
+		info->cfg.parent_dstmask = cb->val.hlen;
+		break;
+	case O_GLOBAL: {
+		struct bpflimit_mt_udata *udata = cb->udata;
+		struct bpflimit_mt_udata ud;
+
+		info->cfg.mode |= XT_BPFLIMIT_GLOBAL;
+		udata->global_bytes = parse_bytes(cb->arg,
+						  &info->cfg.global_avg, &ud, 4);
+		if (!udata->global_bytes &&
+		    !parse_rate(cb->arg, &info->cfg.global_avg, &ud, 4))
+			xtables_param_act(XTF_BAD_VALUE, "bpflimit",
+			          "--bpflimit-global", cb->arg);
+		break;
+	}
+	case O_GLOBAL_BURST:
+		info->cfg.global_burst = parse_burst(cb->arg, 2);
+		break;
+	}
+}
+
 static void bpflimit_check(struct xt_fcheck_call *cb)
 {
 	const struct bpflimit_mt_udata *udata = cb->udata;
@@ -761,7 +1101,7 @@ static void bpflimit_mt_check_v2(struct xt_fcheck_call *cb)
 		burst_error();
 }
 
-static void bpflimit_mt_check(struct xt_fcheck_call *cb)
+static void bpflimit_mt_check_v3(struct xt_fcheck_call *cb)
 {
 	const struct bpflimit_mt_udata *udata = cb->udata;
 	struct xt_bpflimit_mtinfo3 *info = cb->data;
@@ -803,6 +1143,149 @@ static void bpflimit_mt_check(struct xt_fcheck_call *cb)
 	}
 }
 
+/* A second's worth of a fast byte rate is more than the kernel can
+ * hold, above about 37gbit/s the default burst is the most it takes.
+ */
+static uint64_t byte_burst_v4(uint64_t avg)
+{
+	return avg < XT_BPFLIMIT_BYTE_BURST_MAX_v4 ?
+	       avg : XT_BPFLIMIT_BYTE_BURST_MAX_v4;
+}
+
+static void byte_burst_check_v4(uint64_t burst, const char *opt)
+{
+	if (burst > XT_BPFLIMIT_BYTE_BURST_MAX_v4)
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-%s cannot exceed %llub", opt,
+				XT_BPFLIMIT_BYTE_BURST_MAX_v4);
+}
+
+static void bpflimit_mt_check(struct xt_fcheck_call *cb)
+{
+	const struct bpflimit_mt_udata *udata = cb->udata;
+	struct xt_bpflimit_mtinfo4 *info = cb->data;
+
+	if (!(cb->xflags & (F_UPTO | F_ABOVE)))
+		xtables_error(PARAMETER_PROBLEM,
+				"You have to specify --bpflimit");
+	if (!(cb->xflags & F_HTABLE_EXPIRE))
+		info->cfg.expire = udata->mult * 1000; /* from s to msec */
+
+	if (info->cfg.mode & XT_BPFLIMIT_BYTES) {
+		/* rate and burst stay in bytes, a second's worth by default */
+		if (cb->xflags & F_BURST) {
+			byte_burst_check_v4(info->cfg.burst, "burst");
+			if (!(cb->xflags & F_HTABLE_EXPIRE))
+				info->cfg.expire = XT_BPFLIMIT_BYTE_EXPIRE_BURST * 1000;
+		} else if (!(cb->xflags & F_RATEMATCH)) {
+			info->cfg.burst = byte_burst_v4(info->cfg.avg);
+		}
+	} else if (info->cfg.burst > XT_BPFLIMIT_BURST_MAX)
+		burst_error();
+
+	if ((info->cfg.mode & XT_BPFLIMIT_GCRA) &&
+	    (info->cfg.mode & XT_BPFLIMIT_BYTES))
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-gcra only supports packet rates");
+
+	if ((info->cfg.mode & XT_BPFLIMIT_SKETCH) &&
+	    (info->cfg.mode & XT_BPFLIMIT_BYTES))
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-sketch only supports packet rates");
+
+	if ((info->cfg.mode & XT_BPFLIMIT_SKETCH) && info->cfg.admit)
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-admit has no effect with --bpflimit-sketch");
+
+	if ((info->cfg.mode & XT_BPFLIMIT_SKETCH) &&
+	    (info->cfg.mode & (XT_BPFLIMIT_PREALLOC | XT_BPFLIMIT_EVICT)))
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-sketch has no entries to preallocate or evict");
+
+	if ((info->cfg.mode & XT_BPFLIMIT_SKETCH) &&
+	    (info->cfg.maxmem || (info->cfg.mode & XT_BPFLIMIT_SHRINK)))
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-sketch has no entries to limit or shrink");
+
+	if (info->cfg.mode & XT_BPFLIMIT_PARENT) {
+		bool bytes = info->cfg.mode & XT_BPFLIMIT_BYTES;
+
+		if (udata->parent_bytes != bytes)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-parent must use the units of the limit");
+		if (!(info->cfg.mode &
+		      (XT_BPFLIMIT_HASH_SIP | XT_BPFLIMIT_HASH_DIP)))
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-parent needs srcip or dstip in the mode");
+		if (info->cfg.mode & (XT_BPFLIMIT_GCRA | XT_BPFLIMIT_SKETCH) ||
+		    info->cfg.admit)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-parent only works with the token bucket");
+		if (info->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-parent cannot be used with --bpflimit-bpf");
+
+		if (!(cb->xflags & F_PARENT_SRCMASK))
+			info->cfg.parent_srcmask = info->cfg.srcmask;
+		if (!(cb->xflags & F_PARENT_DSTMASK))
+			info->cfg.parent_dstmask = info->cfg.dstmask;
+		if (info->cfg.parent_srcmask > info->cfg.srcmask ||
+		    info->cfg.parent_dstmask > info->cfg.dstmask)
+			xtables_error(PARAMETER_PROBLEM,
+					"parent masks cannot be longer than the key's");
+
+		if (!(cb->xflags & F_PARENT_BURST))
+			info->cfg.parent_burst = bytes ?
+				byte_burst_v4(info->cfg.parent_avg) :
+				XT_BPFLIMIT_BURST;
+		else if (bytes)
+			byte_burst_check_v4(info->cfg.parent_burst,
+					    "parent-burst");
+		else if (info->cfg.parent_burst > XT_BPFLIMIT_BURST_MAX)
+			burst_error();
+	}
+
+	if (info->cfg.mode & XT_BPFLIMIT_GLOBAL) {
+		bool bytes = info->cfg.mode & XT_BPFLIMIT_BYTES;
+
+		if (udata->global_bytes != bytes)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-global must use the units of the limit");
+		if (!(cb->xflags & F_GLOBAL_BURST))
+			info->cfg.global_burst = bytes ?
+				byte_burst_v4(info->cfg.global_avg) :
+				XT_BPFLIMIT_BURST;
+		else if (bytes)
+			byte_burst_check_v4(info->cfg.global_burst,
+					    "global-burst");
+		else if (info->cfg.global_burst > XT_BPFLIMIT_BURST_MAX)
+			burst_error();
+	}
+
+	if (info->cfg.probation > info->cfg.expire)
+		xtables_error(PARAMETER_PROBLEM,
+				"--bpflimit-htable-probation cannot exceed the expire time");
+
+	if (info->cfg.admit) {
+		if (info->cfg.mode & XT_BPFLIMIT_BYTES)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-admit only supports packet rates");
+		if (info->cfg.admit > info->cfg.burst)
+			xtables_error(PARAMETER_PROBLEM,
+					"--bpflimit-admit cannot exceed the burst");
+	}
+
+	/* the rate stays a rate, the window defaults to its unit */
+	if ((cb->xflags & F_RATEMATCH) && info->cfg.interval == 0) {
+		if (info->cfg.mode & XT_BPFLIMIT_BYTES)
+			info->cfg.interval = 1000;
+		else if (udata->msec)
+			info->cfg.interval = udata->msec;
+		else
+			info->cfg.interval = udata->mult * 1000;
+	}
+}
+
 struct rates {
 	const char *name;
 	uint64_t mult;
@@ -817,11 +1300,20 @@ static const struct rates rates[] = {
 	{ "min", XT_BPFLIMIT_SCALE_v2*60 },
 	{ "sec", XT_BPFLIMIT_SCALE_v2 } };
 
+static const struct rates rates_v4[] = {
+	{ "day", XT_BPFLIMIT_SCALE_v4*24*60*60 },
+	{ "hour", XT_BPFLIMIT_SCALE_v4*60*60 },
+	{ "min", XT_BPFLIMIT_SCALE_v4*60 },
+	{ "sec", XT_BPFLIMIT_SCALE_v4 } };
+
 static uint32_t print_rate(uint64_t period, int revision)
 {
 	unsigned int i;
-	const struct rates *_rates = (revision == 1) ? rates_v1 : rates;
-	uint64_t scale = (revision == 1) ? XT_BPFLIMIT_SCALE : XT_BPFLIMIT_SCALE_v2;
+	const struct rates *_rates = (revision == 1) ? rates_v1 :
+				     (revision >= 4) ? rates_v4 : rates;
+	uint64_t scale = (revision == 1) ? XT_BPFLIMIT_SCALE :
+			 (revision >= 4) ? XT_BPFLIMIT_SCALE_v4 :
+			 XT_BPFLIMIT_SCALE_v2;
 
 	if (period == 0) {
 		printf(" %f", INFINITY);
@@ -873,6 +1365,28 @@ static uint32_t print_bytes(uint64_t avg, uint64_t burst, const char *prefix)
 	return XT_BPFLIMIT_BYTE_EXPIRE_BURST * 1000;
 }
 
+/* revision 4 keeps both in bytes, the burst defaults to the rate */
+static uint32_t print_bytes_v4(uint64_t avg, uint64_t burst, const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(units) -1; ++i)
+		if (avg % units[i].thresh == 0)
+			break;
+	printf(" %"PRIu64"%sb/s", avg / units[i].thresh, units[i].name);
+
+	if (burst == avg)
+		return XT_BPFLIMIT_BYTE_EXPIRE * 1000;
+
+	printf(" %s", prefix);
+	for (i = 0; i < ARRAY_SIZE(units) -1; ++i)
+		if (burst % units[i].thresh == 0)
+			break;
+
+	printf("burst %"PRIu64"%sb", burst / units[i].thresh, units[i].name);
+	return XT_BPFLIMIT_BYTE_EXPIRE_BURST * 1000;
+}
+
 static void print_mode(unsigned int mode, char separator)
 {
 	bool prevmode = false;
@@ -923,7 +1437,7 @@ static void bpflimit_print(const void *ip,
 }
 
 static void
-bpflimit_mt_print(const struct bpflimit_cfg3 *cfg, unsigned int dmask, int revision)
+bpflimit_mt_print(const struct bpflimit_cfg4 *cfg, unsigned int dmask, int revision)
 {
 	uint64_t quantum;
 	uint64_t period;
@@ -933,7 +1447,9 @@ bpflimit_mt_print(const struct bpflimit_cfg3 *cfg, unsigned int dmask, int revis
 	else
 		fputs(" limit: up to", stdout);
 
-	if (cfg->mode & XT_BPFLIMIT_BYTES) {
+	if (cfg->mode & XT_BPFLIMIT_BYTES && revision >= 4) {
+		quantum = print_bytes_v4(cfg->avg, cfg->burst, "");
+	} else if (cfg->mode & XT_BPFLIMIT_BYTES) {
 		quantum = print_bytes(cfg->avg, cfg->burst, "");
 	} else {
 		if (revision == 3) {
@@ -966,12 +1482,66 @@ bpflimit_mt_print(const struct bpflimit_cfg3 *cfg, unsigned int dmask, int revis
 	if (cfg->dstmask != dmask)
 		printf(" dstmask %u", cfg->dstmask);
 
-	if ((revision == 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
+	if ((revision >= 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
 		printf(" rate-match");
 
 	if ((revision == 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
 		if (cfg->interval != 1)
 			printf(" rate-interval %u", cfg->interval);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
+		if (cfg->interval != 1000)
+			printf(" rate-interval %ums", cfg->interval);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_GCRA))
+		printf(" gcra");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_EVICT))
+		printf(" htable-evict");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_PREALLOC))
+		printf(" htable-prealloc");
+
+	if ((revision >= 4) && cfg->admit)
+		printf(" admit %u", cfg->admit);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_SKETCH))
+		printf(" sketch");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_PARENT)) {
+		fputs(" parent", stdout);
+		if (cfg->mode & XT_BPFLIMIT_BYTES) {
+			print_bytes_v4(cfg->parent_avg, cfg->parent_burst,
+				       "parent-");
+		} else {
+			print_rate(cfg->parent_avg, revision);
+			printf(" parent-burst %llu", cfg->parent_burst);
+		}
+		if (cfg->parent_srcmask != cfg->srcmask)
+			printf(" parent-srcmask %u", cfg->parent_srcmask);
+		if (cfg->parent_dstmask != cfg->dstmask)
+			printf(" parent-dstmask %u", cfg->parent_dstmask);
+	}
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_GLOBAL)) {
+		fputs(" global", stdout);
+		if (cfg->mode & XT_BPFLIMIT_BYTES) {
+			print_bytes_v4(cfg->global_avg, cfg->global_burst,
+				       "global-");
+		} else {
+			print_rate(cfg->global_avg, revision);
+			printf(" global-burst %llu", cfg->global_burst);
+		}
+	}
+
+	if ((revision >= 4) && cfg->probation != 0)
+		printf(" htable-probation %u", cfg->probation);
+
+	if ((revision >= 4) && cfg->maxmem != 0)
+		printf(" htable-maxmem %llu", cfg->maxmem);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_SHRINK))
+		printf(" htable-shrink");
 }
 
 static void
@@ -979,7 +1549,7 @@ bpflimit_mt4_print_v1(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo1 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 1);
@@ -995,7 +1565,7 @@ bpflimit_mt6_print_v1(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo1 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 1);
@@ -1011,7 +1581,7 @@ bpflimit_mt4_print_v2(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo2 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 2);
@@ -1027,7 +1597,7 @@ bpflimit_mt6_print_v2(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo2 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 2);
@@ -1038,21 +1608,57 @@ bpflimit_mt6_print_v2(const void *ip, const struct xt_entry_match *match,
 	bpflimit_mt_print(&cfg, 128, 2);
 }
 static void
-bpflimit_mt4_print(const void *ip, const struct xt_entry_match *match,
+bpflimit_mt4_print_v3(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo3 *info = (const void *)match->data;
+	struct bpflimit_cfg4 cfg;
+	int ret;
 
-	bpflimit_mt_print(&info->cfg, 32, 3);
+	ret = cfg_copy(&cfg, (const void *)&info->cfg, 3);
+
+	if (ret)
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	bpflimit_mt_print(&cfg, 32, 3);
 }
 
 static void
-bpflimit_mt6_print(const void *ip, const struct xt_entry_match *match,
+bpflimit_mt6_print_v3(const void *ip, const struct xt_entry_match *match,
                    int numeric)
 {
 	const struct xt_bpflimit_mtinfo3 *info = (const void *)match->data;
+	struct bpflimit_cfg4 cfg;
+	int ret;
+
+	ret = cfg_copy(&cfg, (const void *)&info->cfg, 3);
+
+	if (ret)
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	bpflimit_mt_print(&cfg, 128, 3);
+}
 
-	bpflimit_mt_print(&info->cfg, 128, 3);
+static void
+bpflimit_mt4_print(const void *ip, const struct xt_entry_match *match,
+                   int numeric)
+{
+	const struct xt_bpflimit_mtinfo4 *info = (const void *)match->data;
+
+	bpflimit_mt_print(&info->cfg, 32, 4);
+	if (info->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		printf(" bpf %s", info->bpf_path);
+}
+
+static void
+bpflimit_mt6_print(const void *ip, const struct xt_entry_match *match,
+                   int numeric)
+{
+	const struct xt_bpflimit_mtinfo4 *info = (const void *)match->data;
+
+	bpflimit_mt_print(&info->cfg, 128, 4);
+	if (info->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		printf(" bpf %s", info->bpf_path);
 }
 
 static void bpflimit_save(const void *ip, const struct xt_entry_match *match)
@@ -1080,7 +1686,7 @@ static void bpflimit_save(const void *ip, const struct xt_entry_match *match)
 }
 
 static void
-bpflimit_mt_save(const struct bpflimit_cfg3 *cfg, const char* name, unsigned int dmask, int revision)
+bpflimit_mt_save(const struct bpflimit_cfg4 *cfg, const char* name, unsigned int dmask, int revision)
 {
 	uint32_t quantum;
 
@@ -1089,7 +1695,9 @@ bpflimit_mt_save(const struct bpflimit_cfg3 *cfg, const char* name, unsigned int
 	else
 		fputs(" --bpflimit-upto", stdout);
 
-	if (cfg->mode & XT_BPFLIMIT_BYTES) {
+	if (cfg->mode & XT_BPFLIMIT_BYTES && revision >= 4) {
+		quantum = print_bytes_v4(cfg->avg, cfg->burst, "--bpflimit-");
+	} else if (cfg->mode & XT_BPFLIMIT_BYTES) {
 		quantum = print_bytes(cfg->avg, cfg->burst, "--bpflimit-");
 	} else {
 		quantum = print_rate(cfg->avg, revision);
@@ -1118,19 +1726,77 @@ bpflimit_mt_save(const struct bpflimit_cfg3 *cfg, const char* name, unsigned int
 	if (cfg->dstmask != dmask)
 		printf(" --bpflimit-dstmask %u", cfg->dstmask);
 
-	if ((revision == 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
+	if ((revision >= 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
 		printf(" --bpflimit-rate-match");
 
 	if ((revision == 3) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
 		if (cfg->interval != 1)
 			printf(" --bpflimit-rate-interval %u", cfg->interval);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_RATE_MATCH))
+		if (cfg->interval != 1000)
+			printf(" --bpflimit-rate-interval %ums", cfg->interval);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_GCRA))
+		printf(" --bpflimit-gcra");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_EVICT))
+		printf(" --bpflimit-htable-evict");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_PREALLOC))
+		printf(" --bpflimit-htable-prealloc");
+
+	if ((revision >= 4) && cfg->admit)
+		printf(" --bpflimit-admit %u", cfg->admit);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_SKETCH))
+		printf(" --bpflimit-sketch");
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_PARENT)) {
+		fputs(" --bpflimit-parent", stdout);
+		if (cfg->mode & XT_BPFLIMIT_BYTES) {
+			print_bytes_v4(cfg->parent_avg, cfg->parent_burst,
+				       "--bpflimit-parent-");
+		} else {
+			print_rate(cfg->parent_avg, revision);
+			printf(" --bpflimit-parent-burst %llu",
+			       cfg->parent_burst);
+		}
+		if (cfg->parent_srcmask != cfg->srcmask)
+			printf(" --bpflimit-parent-srcmask %u",
+			       cfg->parent_srcmask);
+		if (cfg->parent_dstmask != cfg->dstmask)
+			printf(" --bpflimit-parent-dstmask %u",
+			       cfg->parent_dstmask);
+	}
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_GLOBAL)) {
+		fputs(" --bpflimit-global", stdout);
+		if (cfg->mode & XT_BPFLIMIT_BYTES) {
+			print_bytes_v4(cfg->global_avg, cfg->global_burst,
+				       "--bpflimit-global-");
+		} else {
+			print_rate(cfg->global_avg, revision);
+			printf(" --bpflimit-global-burst %llu",
+			       cfg->global_burst);
+		}
+	}
+
+	if ((revision >= 4) && cfg->probation != 0)
+		printf(" --bpflimit-htable-probation %u", cfg->probation);
+
+	if ((revision >= 4) && cfg->maxmem != 0)
+		printf(" --bpflimit-htable-maxmem %llu", cfg->maxmem);
+
+	if ((revision >= 4) && (cfg->mode & XT_BPFLIMIT_SHRINK))
+		printf(" --bpflimit-htable-shrink");
 }
 
 static void
 bpflimit_mt4_save_v1(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo1 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 1);
@@ -1145,7 +1811,7 @@ static void
 bpflimit_mt6_save_v1(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo1 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 1);
@@ -1160,7 +1826,7 @@ static void
 bpflimit_mt4_save_v2(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo2 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 2);
@@ -1175,7 +1841,7 @@ static void
 bpflimit_mt6_save_v2(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo2 *info = (const void *)match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 	int ret;
 
 	ret = cfg_copy(&cfg, (const void *)&info->cfg, 2);
@@ -1187,19 +1853,53 @@ bpflimit_mt6_save_v2(const void *ip, const struct xt_entry_match *match)
 }
 
 static void
-bpflimit_mt4_save(const void *ip, const struct xt_entry_match *match)
+bpflimit_mt4_save_v3(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo3 *info = (const void *)match->data;
+	struct bpflimit_cfg4 cfg;
+	int ret;
+
+	ret = cfg_copy(&cfg, (const void *)&info->cfg, 3);
 
-	bpflimit_mt_save(&info->cfg, info->name, 32, 3);
+	if (ret)
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	bpflimit_mt_save(&cfg, info->name, 32, 3);
 }
 
 static void
-bpflimit_mt6_save(const void *ip, const struct xt_entry_match *match)
+bpflimit_mt6_save_v3(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_bpflimit_mtinfo3 *info = (const void *)match->data;
+	struct bpflimit_cfg4 cfg;
+	int ret;
+
+	ret = cfg_copy(&cfg, (const void *)&info->cfg, 3);
 
-	bpflimit_mt_save(&info->cfg, info->name, 128, 3);
+	if (ret)
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	bpflimit_mt_save(&cfg, info->name, 128, 3);
+}
+
+static void
+bpflimit_mt4_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_bpflimit_mtinfo4 *info = (const void *)match->data;
+
+	bpflimit_mt_save(&info->cfg, info->name, 32, 4);
+	if (info->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		printf(" --bpflimit-bpf %s", info->bpf_path);
+}
+
+static void
+bpflimit_mt6_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_bpflimit_mtinfo4 *info = (const void *)match->data;
+
+	bpflimit_mt_save(&info->cfg, info->name, 128, 4);
+	if (info->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		printf(" --bpflimit-bpf %s", info->bpf_path);
 }
 
 /*
@@ -1215,12 +1915,18 @@ static const struct rates rates_xlate[] = {
 	{ "minute", XT_BPFLIMIT_SCALE_v2 * 60 },
 	{ "second", XT_BPFLIMIT_SCALE_v2 } };
 
+static const struct rates rates_v4_xlate[] = {
+	{ "day", XT_BPFLIMIT_SCALE_v4 * 24 * 60 * 60 },
+	{ "hour", XT_BPFLIMIT_SCALE_v4 * 60 * 60 },
+	{ "minute", XT_BPFLIMIT_SCALE_v4 * 60 },
+	{ "second", XT_BPFLIMIT_SCALE_v4 } };
+
 static void print_packets_rate_xlate(struct xt_xlate *xl, uint64_t avg,
 				     int revision)
 {
 	unsigned int i;
-	const struct rates *_rates = (revision == 1) ?
-		rates_v1_xlate : rates_xlate;
+	const struct rates *_rates = (revision == 1) ? rates_v1_xlate :
+		(revision >= 4) ? rates_v4_xlate : rates_xlate;
 
 	for (i = 1; i < ARRAY_SIZE(rates); ++i)
 		if (avg > _rates[i].mult ||
@@ -1232,7 +1938,7 @@ static void print_packets_rate_xlate(struct xt_xlate *xl, uint64_t avg,
 }
 
 static void print_bytes_rate_xlate(struct xt_xlate *xl,
-				   const struct bpflimit_cfg3 *cfg)
+				   const struct bpflimit_cfg4 *cfg)
 {
 	unsigned int i;
 	unsigned long long r;
@@ -1340,7 +2046,7 @@ static int bpflimit_mode_xlate(struct xt_xlate *xl,
 }
 
 static int bpflimit_mt_xlate(struct xt_xlate *xl, const char *name,
-			      const struct bpflimit_cfg3 *cfg,
+			      const struct bpflimit_cfg4 *cfg,
 			      int revision, int family)
 {
 	int ret = 1;
@@ -1389,7 +2095,7 @@ static int bpflimit_mt4_xlate_v1(struct xt_xlate *xl,
 {
 	const struct xt_bpflimit_mtinfo1 *info =
 		(const void *)params->match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 
 	if (cfg_copy(&cfg, (const void *)&info->cfg, 1))
 		xtables_error(OTHER_PROBLEM, "unknown revision");
@@ -1402,7 +2108,7 @@ static int bpflimit_mt6_xlate_v1(struct xt_xlate *xl,
 {
 	const struct xt_bpflimit_mtinfo1 *info =
 		(const void *)params->match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 
 	if (cfg_copy(&cfg, (const void *)&info->cfg, 1))
 		xtables_error(OTHER_PROBLEM, "unknown revision");
@@ -1415,7 +2121,7 @@ static int bpflimit_mt4_xlate_v2(struct xt_xlate *xl,
 {
 	const struct xt_bpflimit_mtinfo2 *info =
 		(const void *)params->match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 
 	if (cfg_copy(&cfg, (const void *)&info->cfg, 2))
 		xtables_error(OTHER_PROBLEM, "unknown revision");
@@ -1428,7 +2134,7 @@ static int bpflimit_mt6_xlate_v2(struct xt_xlate *xl,
 {
 	const struct xt_bpflimit_mtinfo2 *info =
 		(const void *)params->match->data;
-	struct bpflimit_cfg3 cfg;
+	struct bpflimit_cfg4 cfg;
 
 	if (cfg_copy(&cfg, (const void *)&info->cfg, 2))
 		xtables_error(OTHER_PROBLEM, "unknown revision");
@@ -1436,22 +2142,48 @@ static int bpflimit_mt6_xlate_v2(struct xt_xlate *xl,
 	return bpflimit_mt_xlate(xl, info->name, &cfg, 2, NFPROTO_IPV6);
 }
 
+static int bpflimit_mt4_xlate_v3(struct xt_xlate *xl,
+				  const struct xt_xlate_mt_params *params)
+{
+	const struct xt_bpflimit_mtinfo3 *info =
+		(const void *)params->match->data;
+	struct bpflimit_cfg4 cfg;
+
+	if (cfg_copy(&cfg, (const void *)&info->cfg, 3))
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	return bpflimit_mt_xlate(xl, info->name, &cfg, 3, NFPROTO_IPV4);
+}
+
+static int bpflimit_mt6_xlate_v3(struct xt_xlate *xl,
+				  const struct xt_xlate_mt_params *params)
+{
+	const struct xt_bpflimit_mtinfo3 *info =
+		(const void *)params->match->data;
+	struct bpflimit_cfg4 cfg;
+
+	if (cfg_copy(&cfg, (const void *)&info->cfg, 3))
+		xtables_error(OTHER_PROBLEM, "unknown revision");
+
+	return bpflimit_mt_xlate(xl, info->name, &cfg, 3, NFPROTO_IPV6);
+}
+
 static int bpflimit_mt4_xlate(struct xt_xlate *xl,
 			       const struct xt_xlate_mt_params *params)
 {
-	const struct xt_bpflimit_mtinfo3 *info =
+	const struct xt_bpflimit_mtinfo4 *info =
 		(const void *)params->match->data;
 
-	return bpflimit_mt_xlate(xl, info->name, &info->cfg, 3, NFPROTO_IPV4);
+	return bpflimit_mt_xlate(xl, info->name, &info->cfg, 4, NFPROTO_IPV4);
 }
 
 static int bpflimit_mt6_xlate(struct xt_xlate *xl,
 			       const struct xt_xlate_mt_params *params)
 {
-	const struct xt_bpflimit_mtinfo3 *info =
+	const struct xt_bpflimit_mtinfo4 *info =
 		(const void *)params->match->data;
 
-	return bpflimit_mt_xlate(xl, info->name, &info->cfg, 3, NFPROTO_IPV6);
+	return bpflimit_mt_xlate(xl, info->name, &info->cfg, 4, NFPROTO_IPV6);
 }
 */
 
@@ -1549,6 +2281,23 @@ static struct xtables_match bpflimit_mt_reg[] = {
 		.size          = XT_ALIGN(sizeof(struct xt_bpflimit_mtinfo3)),
 		.userspacesize = offsetof(struct xt_bpflimit_mtinfo3, hinfo),
 		.help          = bpflimit_mt_help_v3,
+		.init          = bpflimit_mt4_init_v3,
+		.x6_parse      = bpflimit_mt_parse_v3,
+		.x6_fcheck     = bpflimit_mt_check_v3,
+		.print         = bpflimit_mt4_print_v3,
+		.save          = bpflimit_mt4_save_v3,
+		.x6_options    = bpflimit_mt_opts_v3,
+		.udata_size    = sizeof(struct bpflimit_mt_udata),
+//		.xlate         = bpflimit_mt4_xlate_v3,
+	},
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "bpflimit",
+		.revision      = 4,
+		.family        = NFPROTO_IPV4,
+		.size          = XT_ALIGN(sizeof(struct xt_bpflimit_mtinfo4)),
+		.userspacesize = offsetof(struct xt_bpflimit_mtinfo4, hinfo),
+		.help          = bpflimit_mt_help_v4,
 		.init          = bpflimit_mt4_init,
 		.x6_parse      = bpflimit_mt_parse,
 		.x6_fcheck     = bpflimit_mt_check,
@@ -1566,6 +2315,23 @@ static struct xtables_match bpflimit_mt_reg[] = {
 		.size          = XT_ALIGN(sizeof(struct xt_bpflimit_mtinfo3)),
 		.userspacesize = offsetof(struct xt_bpflimit_mtinfo3, hinfo),
 		.help          = bpflimit_mt_help_v3,
+		.init          = bpflimit_mt6_init_v3,
+		.x6_parse      = bpflimit_mt_parse_v3,
+		.x6_fcheck     = bpflimit_mt_check_v3,
+		.print         = bpflimit_mt6_print_v3,
+		.save          = bpflimit_mt6_save_v3,
+		.x6_options    = bpflimit_mt_opts_v3,
+		.udata_size    = sizeof(struct bpflimit_mt_udata),
+//		.xlate         = bpflimit_mt6_xlate_v3,
+	},
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "bpflimit",
+		.revision      = 4,
+		.family        = NFPROTO_IPV6,
+		.size          = XT_ALIGN(sizeof(struct xt_bpflimit_mtinfo4)),
+		.userspacesize = offsetof(struct xt_bpflimit_mtinfo4, hinfo),
+		.help          = bpflimit_mt_help_v4,
 		.init          = bpflimit_mt6_init,
 		.x6_parse      = bpflimit_mt_parse,
 		.x6_fcheck     = bpflimit_mt_check,
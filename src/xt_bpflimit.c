@@ -14,6 +14,8 @@
 #include <linux/spinlock.h>
 #include <linux/random.h>
 #include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/proc_fs.h>
@@ -23,6 +25,10 @@
 #include <linux/mm.h>
 #include <linux/in.h>
 #include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
 #if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
 #include <linux/ipv6.h>
 #include <net/ipv6.h>
@@ -38,6 +44,10 @@
 #include "xt_bpflimit.h"
 #include <linux/mutex.h>
 #include <linux/kernel.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Harald Welte <laforge@netfilter.org>");
@@ -51,6 +61,8 @@ struct bpflimit_net {
 	struct hlist_head	htables;
 	struct proc_dir_entry	*ipt_bpflimit;
 	struct proc_dir_entry	*ip6t_bpflimit;
+	struct delayed_work	gc_work;	/* gc of all htables */
+	unsigned long		gc_next;	/* when gc_work is due */
 };
 
 static unsigned int bpflimit_net_id;
@@ -72,10 +84,12 @@ static const struct seq_operations dl_seq_ops_v2;
 static const struct seq_operations dl_seq_ops_v1;
 static const struct seq_operations dl_seq_ops;
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
-static int dl_proc_open_v2(struct inode *inode, struct file *file)
+static ssize_t dl_proc_write(struct file *file, const char __user *input,
+			     size_t size, loff_t *loff);
+
+static int dl_proc_open(struct inode *inode, struct file *file)
 {
-	int ret = seq_open(file, &dl_seq_ops_v2);
+	int ret = seq_open(file, &dl_seq_ops);
 
 	if (!ret) {
 		struct seq_file *sf = file->private_data;
@@ -85,24 +99,25 @@ static int dl_proc_open_v2(struct inode *inode, struct file *file)
 	return ret;
 }
 
-static int dl_proc_open_v1(struct inode *inode, struct file *file)
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
+static int dl_proc_open_v2(struct inode *inode, struct file *file)
 {
-	int ret = seq_open(file, &dl_seq_ops_v1);
+	int ret = seq_open(file, &dl_seq_ops_v2);
 
 	if (!ret) {
 		struct seq_file *sf = file->private_data;
+
 		sf->private = PDE_DATA(inode);
 	}
 	return ret;
 }
 
-static int dl_proc_open(struct inode *inode, struct file *file)
+static int dl_proc_open_v1(struct inode *inode, struct file *file)
 {
-	int ret = seq_open(file, &dl_seq_ops);
+	int ret = seq_open(file, &dl_seq_ops_v1);
 
 	if (!ret) {
 		struct seq_file *sf = file->private_data;
-
 		sf->private = PDE_DATA(inode);
 	}
 	return ret;
@@ -125,15 +140,38 @@ static const struct file_operations dl_file_ops_v1 = {
 static const struct file_operations dl_file_ops = {
 	.open    = dl_proc_open,
 	.read    = seq_read,
+	.write   = dl_proc_write,
+	.llseek  = seq_lseek,
+	.release = seq_release
+};
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+/* revision 4 tables take pinned keys, see dl_proc_write() */
+static const struct file_operations dl_proc_ops = {
+	.open    = dl_proc_open,
+	.read    = seq_read,
+	.write   = dl_proc_write,
 	.llseek  = seq_lseek,
 	.release = seq_release
 };
+#else
+static const struct proc_ops dl_proc_ops = {
+	.proc_open    = dl_proc_open,
+	.proc_read    = seq_read,
+	.proc_write   = dl_proc_write,
+	.proc_lseek   = seq_lseek,
+	.proc_release = seq_release
+};
 #endif
 
 
 
 /* hash table crap */
+
+/* The address union is last so IPv4 tables can cut the key short */
 struct dsthash_dst {
+	__u32 bpf;
+	__be16 src_port;
+	__be16 dst_port;
 	union {
 		struct {
 			__be32 src;
@@ -146,62 +184,211 @@ struct dsthash_dst {
 		} ip6;
 #endif
 	};
-	__be16 src_port;
-	__be16 dst_port;
-	__u64 bpf;
 };
 
+#define DSTHASH_KEYLEN_IPV4	offsetofend(struct dsthash_dst, ip)
+#define DSTHASH_KEYLEN_IPV6	sizeof(struct dsthash_dst)
+
+/* XT_BPFLIMIT_PARENT: aggregate entries share the table with the keys
+ * they cover and are told apart by dst.bpf.  A table cannot hash on
+ * both, so the whole word is free and every bpf return value stays
+ * a key of its own. */
+#define DSTHASH_PARENT		1U
+
+/* Everything up to and including dst is touched on lookup and comes
+ * first.  The slab cache is cacheline aligned, so for IPv4 those 64
+ * bytes are a single line; IPv6 keys take a second one.  What only
+ * frees and aggregates need goes behind the key.  Values that are the
+ * same for every entry live in the htable.
+ */
 struct dsthash_ent {
-	/* static / read-only parts in the beginning */
 	struct hlist_node node;
-	struct dsthash_dst dst;
-
-	/* modified structure members in the end */
-	spinlock_t lock;
-	unsigned long expires;		/* precalculated expiry time */
+	u_int32_t expires;		/* bpflimit_stamp, see stamp_before */
+	u_int32_t gen;			/* table generation, see dsthash_stale */
 	struct {
-		unsigned long prev;	/* last modification */
+		spinlock_t lock;
+		union {
+			u_int32_t credit_cap;	/* bytes: refills left */
+			u_int32_t prev_window;	/* rate match, count in v4 */
+			u_int32_t rate_id;	/* v4: pinned rate, 0 if none */
+		};
+		u64 prev;		/* last modification, see bpflimit_clock */
 		union {
-			struct {
-				u_int64_t credit;
-				u_int64_t credit_cap;
-				u_int64_t cost;
-			};
-			struct {
-				u_int32_t interval, prev_window;
-				u_int64_t current_rate;
-				u_int64_t rate;
-				int64_t burst;
-			};
+			u_int64_t credit;
+			u_int64_t current_rate;
+			/* theoretical arrival time, XT_BPFLIMIT_GCRA */
+			atomic64_t tat;
 		};
 	} rateinfo;
+	struct dsthash_dst dst;
+
+	struct rcu_head rcu;
+	struct xt_bpflimit_htable *ht;	/* PREALLOC: magazine to free to */
+	union {
+		struct dsthash_ent *parent;	/* aggregate of a child */
+		atomic_t children;		/* children of an aggregate */
+	};
+};
+
+/* Entries keep their expiry in 32 bits of jiffies, like conntrack.
+ * Expire times are far below 2^31 jiffies, and gc frees an entry long
+ * before its stamp could wrap around.
+ */
+#define bpflimit_stamp ((u32)jiffies)
+
+static inline bool stamp_before(u32 a, u32 b)
+{
+	return (s32)(a - b) < 0;
+}
+
+/* count-min sketch rows, and the minimum row width */
+#define BPFLIMIT_CMS_DEPTH 4
+#define BPFLIMIT_CMS_MIN_BITS 8
+
+/* per-cpu stock of unpublished entries, linked through ent->node */
+struct bpflimit_mag {
+	spinlock_t lock;
+	unsigned int count;
+	bool low;			/* wants a refill */
+	struct hlist_head free;
+};
+
+/* Bucket arrays are powers of two and indexed by the low bits of the
+ * key hash.  The lock stripe is taken from the same bits and there are
+ * never more stripes than buckets, so one stripe covers a key in any
+ * table size and entries can be moved between tables under it.
+ */
+struct dsthash_table {
+	unsigned int size;
+	struct hlist_head hash[];
+};
+
+/* Rates pinned to single keys through the proc file, in the units of
+ * cfg.  Entries refer to them by index + 1 in rateinfo.rate_id.  Keys
+ * with the same rate share one; they are never removed, so an index
+ * stays valid for the lifetime of the table.
+ */
+#define BPFLIMIT_RATES_MAX 1024
+
+struct bpflimit_rate {
+	u64 avg;
+	u64 burst;
+	union {
+		struct {
+			u64 cost;	/* per ns in byte mode */
+			u64 credit_cap;
+			u64 fill;	/* ns to fill the burst */
+		};
+		struct {
+			u64 gcra_t;
+			u64 gcra_tau;
+		};
+	};
+};
+
+struct bpflimit_rates {
 	struct rcu_head rcu;
+	unsigned int n;
+	struct bpflimit_rate r[];
 };
 
 struct xt_bpflimit_htable {
 	struct hlist_node node;		/* global list of all htables */
 	int use;
 	u_int8_t family;
-	bool rnd_initialized;
 
-	struct bpflimit_cfg3 cfg;	/* config */
+	struct bpflimit_cfg4 cfg;	/* config */
+	struct bpf_prog *prog;		/* key program, XT_BPFLIMIT_HASH_BPF */
+	struct {
+		u64 cost;		/* per ns in byte mode */
+		u64 credit_cap;
+		u64 fill;		/* ns to fill the burst */
+	} parent;			/* aggregate bucket, XT_BPFLIMIT_PARENT */
+	struct {
+		atomic64_t credit;	/* shared pool */
+		atomic64_t prev;	/* last refill, ns */
+		u64 cost;		/* per ns in byte mode */
+		u64 credit_cap;
+		u64 fill;		/* ns to fill the burst */
+		u64 batch;		/* taken from the pool at once */
+		u64 __percpu *local;	/* taken but not spent yet */
+	} global;			/* table ceiling, XT_BPFLIMIT_GLOBAL */
+	struct bpflimit_rates __rcu *rates;	/* pinned keys */
+	struct mutex rates_lock;	/* serialises adding rates */
 
 	/* used internally */
-	spinlock_t lock;		/* lock for list_head */
+	spinlock_t *locks;		/* striped bucket locks */
+	unsigned int lock_mask;		/* bucket -> lock stripe */
 	u_int32_t rnd;			/* random seed for hash */
-	unsigned int count;		/* number entries in table */
-	struct delayed_work gc_work;
+	struct percpu_counter count;	/* number entries in table */
+	struct kmem_cache *cachep;	/* entry cache, bpflimit_cachep */
+	struct bpflimit_mag __percpu *mags;
+	unsigned int mag_cap;		/* entries per magazine */
+	atomic_t mag_stock;		/* entries in all magazines */
+	size_t table_bytes;		/* bucket arrays, both during resize */
+	struct work_struct mag_work;	/* refills magazines */
+	unsigned int keylen;		/* bytes of dsthash_dst in use */
+	unsigned int entsize;		/* slab object size of an entry */
+	unsigned int keyoff;		/* first word cfg.mode hashes on */
+	unsigned int keywords;		/* words cfg.mode hashes on */
+	atomic_t *cms;			/* admission sketch, cfg.admit */
+	atomic64_t *cells;		/* GCRA sketch, XT_BPFLIMIT_SKETCH */
+	unsigned int cms_bits;		/* log2 of the row width */
+	u_int32_t cms_seed[BPFLIMIT_CMS_DEPTH];
+	u64 cms_drained;		/* clock the sketch has leaked up to */
+	union {
+		struct {
+			u_int64_t cost;
+			u_int64_t credit_cap;
+			u64 fill;	/* ns bytes: time to fill the burst */
+		};
+		struct {
+			u_int64_t rate;
+			int64_t burst;
+			u64 interval;	/* seconds, ns in a v4 window */
+			unsigned int shift; /* keeps interval in 32 bits */
+		};
+		struct {
+			u64 gcra_t;	/* emission interval, ns */
+			u64 gcra_tau;	/* burst tolerance, ns */
+		};
+	} rateinfo;			/* shared by all entries */
+	unsigned long gc_due;		/* next gc run, see bpflimit_gc_work */
+	u_int32_t gen;			/* bumped by a flush */
+	struct {
+		unsigned long *map;	/* a bit per chunk, for each slot */
+		unsigned int slots;	/* power of two */
+		unsigned int chunks;	/* power of two, at most cfg.size */
+		unsigned long tick;	/* jiffies per slot, gc_interval */
+		unsigned long done;	/* slots gc went through */
+		unsigned long due;	/* when slot done + 1 is due */
+		bool partial;		/* slot done is not through yet */
+		u64 pass_ns;		/* spent on slot done so far */
+		unsigned int pass_freed;
+		u64 last_ns, max_ns;	/* of whole passes, in the proc file */
+		unsigned int last_freed;
+	} wheel;			/* expiry, see wheel_mark() */
+	int revision;			/* revision that created the table */
+	bool ns;			/* rate state runs on ktime ns */
+	struct mem_cgroup *memcg;	/* charged for entries and buckets */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	struct shrinker *shrinker;	/* XT_BPFLIMIT_SHRINK */
+#else
+	struct shrinker shrinker;	/* XT_BPFLIMIT_SHRINK */
+#endif
+	unsigned int shrink_pos;	/* next bucket the shrinker looks at */
 
 	/* seq_file stuff */
 	struct proc_dir_entry *pde;
 	const char *name;
 	struct net *net;
 
-	struct hlist_head hash[0];	/* hashtable itself */
+	struct dsthash_table __rcu *table;	/* hashtable itself */
+	struct dsthash_table __rcu *future;	/* resize in progress */
 };
 
 static int
-cfg_copy(struct bpflimit_cfg3 *to, const void *from, int revision)
+cfg_copy(struct bpflimit_cfg4 *to, const void *from, int revision)
 {
 	if (revision == 1) {
 		struct bpflimit_cfg1 *cfg = (struct bpflimit_cfg1 *)from;
@@ -228,7 +415,20 @@ cfg_copy(struct bpflimit_cfg3 *to, const void *from, int revision)
 		to->srcmask = cfg->srcmask;
 		to->dstmask = cfg->dstmask;
 	} else if (revision == 3) {
-		memcpy(to, from, sizeof(struct bpflimit_cfg3));
+		struct bpflimit_cfg3 *cfg = (struct bpflimit_cfg3 *)from;
+
+		to->mode = cfg->mode;
+		to->avg = cfg->avg;
+		to->burst = cfg->burst;
+		to->size = cfg->size;
+		to->max = cfg->max;
+		to->gc_interval = cfg->gc_interval;
+		to->expire = cfg->expire;
+		to->interval = cfg->interval;
+		to->srcmask = cfg->srcmask;
+		to->dstmask = cfg->dstmask;
+	} else if (revision == 4) {
+		memcpy(to, from, sizeof(struct bpflimit_cfg4));
 	} else {
 		return -EINVAL;
 	}
@@ -245,91 +445,526 @@ static int xt_check_proc_name(const char* name, unsigned int size){
 
 #endif
 
+/* bucket lock stripes allocated per possible cpu */
+#define BPFLIMIT_LOCKS_PER_CPU 32
+
 static DEFINE_MUTEX(bpflimit_mutex);	/* protects htables list */
 static struct kmem_cache *bpflimit_cachep __read_mostly;
 
-static inline bool dst_cmp(const struct dsthash_ent *ent,
+/* Revision 4 keeps all rate state in nanoseconds, so refills and
+ * windows are not quantised to a tick.  Tables of older revisions still
+ * count jiffies.  Expiry is always in jiffies.
+ */
+static inline u64 bpflimit_clock(const struct xt_bpflimit_htable *ht)
+{
+	return ht->ns ? ktime_get_ns() : get_jiffies_64();
+}
+
+/* On a ns clock one credit is one nanosecond: an entry gains a credit
+ * per ns and a packet costs its interval.  XT_BPFLIMIT_SCALE_v4 divides
+ * NSEC_PER_SEC, so the conversion is exact.
+ */
+#define NS_PER_USER (NSEC_PER_SEC / XT_BPFLIMIT_SCALE_v4)
+
+static inline u64 user2ns(u64 user)
+{
+	return user * NS_PER_USER;
+}
+
+/* Only the words between keyoff and keyoff + keywords are ever
+ * filled in by bpflimit_init_dst(), hashed and compared.  The common
+ * modes need one to three words, and those get unrolled below.
+ */
+static inline const u32 *
+dsthash_key(const struct xt_bpflimit_htable *ht, const struct dsthash_dst *dst)
+{
+	return (const u32 *)((const char *)dst + ht->keyoff);
+}
+
+static inline bool dsthash_is_parent(const struct xt_bpflimit_htable *ht,
+				     const struct dsthash_dst *dst)
+{
+	return ht->cfg.mode & XT_BPFLIMIT_PARENT && dst->bpf == DSTHASH_PARENT;
+}
+
+/* Only revision 4 token buckets and GCRA leave the rate_id slot free */
+static inline bool bpflimit_can_pin(const struct xt_bpflimit_htable *ht)
+{
+	return ht->ns &&
+	       !(ht->cfg.mode & (XT_BPFLIMIT_RATE_MATCH | XT_BPFLIMIT_SKETCH));
+}
+
+/* the pinned rate of @ent, or NULL for the table's */
+static inline const struct bpflimit_rate *
+dsthash_rate(const struct xt_bpflimit_htable *ht,
+	     const struct dsthash_ent *ent)
+{
+	u32 id;
+
+	if (!bpflimit_can_pin(ht))
+		return NULL;
+	/* pairs with dsthash_pin(), the rates it indexes are published */
+	id = smp_load_acquire(&ent->rateinfo.rate_id);
+	if (likely(id == 0))
+		return NULL;
+	return &rcu_dereference_bh(ht->rates)->r[id - 1];
+}
+
+static inline bool dst_cmp(const struct xt_bpflimit_htable *ht,
+			   const struct dsthash_ent *ent,
 			   const struct dsthash_dst *b)
 {
-	return !memcmp(&ent->dst, b, sizeof(ent->dst));
+	const u32 *x = dsthash_key(ht, &ent->dst);
+	const u32 *y = dsthash_key(ht, b);
+
+	switch (ht->keywords) {
+	case 1:
+		return x[0] == y[0];
+	case 2:
+		return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0;
+	case 3:
+		return ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2])) == 0;
+	default:
+		return !memcmp(x, y, ht->keywords * sizeof(u32));
+	}
 }
 
 static u_int32_t
-hash_dst(const struct xt_bpflimit_htable *ht, const struct dsthash_dst *dst)
-{
-	u_int32_t hash = jhash2((const u32 *)dst,
-				sizeof(*dst)/sizeof(u32),
-				ht->rnd);
-	/*
-	 * Instead of returning hash % ht->cfg.size (implying a divide)
-	 * we return the high 32 bits of the (hash * ht->cfg.size) that will
-	 * give results between [0 and cfg.size-1] and same hash distribution,
-	 * but using a multiply, less expensive than a divide
-	 */
-	return reciprocal_scale(hash, ht->cfg.size);
+hash_key(const struct xt_bpflimit_htable *ht, const struct dsthash_dst *dst)
+{
+	const u32 *k = dsthash_key(ht, dst);
+	u_int32_t hash;
+
+	switch (ht->keywords) {
+	case 1:
+		hash = jhash_1word(k[0], ht->rnd);
+		break;
+	case 2:
+		hash = jhash_2words(k[0], k[1], ht->rnd);
+		break;
+	case 3:
+		hash = jhash_3words(k[0], k[1], k[2], ht->rnd);
+		break;
+	default:
+		hash = jhash2(k, ht->keywords, ht->rnd);
+	}
+	return hash;
+}
+
+static inline struct hlist_head *
+dsthash_bucket(struct dsthash_table *t, u_int32_t hash)
+{
+	return &t->hash[hash & (t->size - 1)];
+}
+
+/* works with both a key hash and a bucket index, see dsthash_table */
+static inline spinlock_t *
+dsthash_lock(const struct xt_bpflimit_htable *ht, u_int32_t hash)
+{
+	return &ht->locks[hash & ht->lock_mask];
+}
+
+/* Entries of an older generation were flushed: lookups pass them by
+ * and gc or the next insert in their bucket frees them.  Pinned keys
+ * outlive a flush and are only caught up with once unpinned.
+ */
+static inline bool dsthash_stale(const struct xt_bpflimit_htable *ht,
+				 const struct dsthash_ent *ent)
+{
+	return ent->gen != READ_ONCE(ht->gen) &&
+	       !(bpflimit_can_pin(ht) && READ_ONCE(ent->rateinfo.rate_id));
 }
 
 static struct dsthash_ent *
 dsthash_find(const struct xt_bpflimit_htable *ht,
-	     const struct dsthash_dst *dst)
+	     struct dsthash_table *t,
+	     const struct dsthash_dst *dst, u_int32_t hash)
 {
+	struct hlist_head *head = dsthash_bucket(t, hash);
 	struct dsthash_ent *ent;
-	u_int32_t hash = hash_dst(ht, dst);
 
-	if (!hlist_empty(&ht->hash[hash])) {
-		hlist_for_each_entry_rcu(ent, &ht->hash[hash], node)
-			if (dst_cmp(ent, dst)) {
-				spin_lock(&ent->lock);
+	if (!hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
+			if (dst_cmp(ht, ent, dst) && !dsthash_stale(ht, ent))
 				return ent;
-			}
 	}
 	return NULL;
 }
 
-/* allocate dsthash_ent, initialize dst, put in htable and lock it */
+static inline size_t dsthash_table_bytes(unsigned int size)
+{
+	return sizeof(struct dsthash_table) + sizeof(struct hlist_head) * size;
+}
+
+/* Entries and bucket arrays are charged to the memory cgroup of the
+ * task that created the table, so rules in a container count against
+ * its limit.  Packets allocate in softirq and gc in a kworker, neither
+ * has the right task to charge, hence the explicit active memcg.
+ */
+#if IS_ENABLED(CONFIG_MEMCG) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+static inline struct mem_cgroup *
+htable_memcg_enter(const struct xt_bpflimit_htable *ht)
+{
+	return set_active_memcg(ht->memcg);
+}
+
+static inline void htable_memcg_exit(struct mem_cgroup *old)
+{
+	set_active_memcg(old);
+}
+
+static void htable_memcg_init(struct xt_bpflimit_htable *ht)
+{
+	ht->memcg = get_mem_cgroup_from_mm(current->mm);
+}
+
+static void htable_memcg_put(struct xt_bpflimit_htable *ht)
+{
+	mem_cgroup_put(ht->memcg);
+}
+#else
+static inline struct mem_cgroup *
+htable_memcg_enter(const struct xt_bpflimit_htable *ht)
+{
+	return NULL;
+}
+
+static inline void htable_memcg_exit(struct mem_cgroup *old)
+{
+}
+
+static void htable_memcg_init(struct xt_bpflimit_htable *ht)
+{
+	ht->memcg = NULL;
+}
+
+static void htable_memcg_put(struct xt_bpflimit_htable *ht)
+{
+}
+#endif
+
+static struct dsthash_table *
+dsthash_table_alloc(const struct xt_bpflimit_htable *ht, unsigned int size)
+{
+	struct dsthash_table *t;
+	struct mem_cgroup *old;
+	unsigned int i;
+
+	old = htable_memcg_enter(ht);
+	t = kvmalloc(dsthash_table_bytes(size), GFP_KERNEL_ACCOUNT);
+	htable_memcg_exit(old);
+	if (t == NULL)
+		return NULL;
+
+	t->size = size;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&t->hash[i]);
+	return t;
+}
+
+static void rateinfo_init(struct dsthash_ent *dh,
+			  struct xt_bpflimit_htable *hinfo,
+			  u64 now, u32 spent, int revision);
+static void htable_rateinfo_init(struct xt_bpflimit_htable *hinfo,
+				 int revision);
+static bool dsthash_evict(struct xt_bpflimit_htable *ht,
+			  struct dsthash_table *t, u_int32_t hash);
+static void dsthash_reap(struct xt_bpflimit_htable *ht,
+			 struct dsthash_table *t, u_int32_t hash,
+			 const struct dsthash_ent *keep);
+
+/* Expiry runs on a wheel of gc_interval slots.  Each slot has a bit
+ * per chunk of buckets, a chunk being the buckets whose index is equal
+ * in the low bits, so it holds the same keys whatever the table size.
+ * A bit says some entry of the chunk may be due in that slot.
+ *
+ * Only inserts set bits, packets that refresh an entry do not.  When
+ * gc goes through a slot it scans the chunks set there, frees what has
+ * expired and marks the chunk again for the earliest entry left.  An
+ * active key thus costs a visit per expiry period rather than one per
+ * gc run, and a table with nothing due costs nothing.  Bits are only
+ * hints and may point at entries that were freed in the meantime.
+ */
+#define BPFLIMIT_WHEEL_SLOTS 64
+#define BPFLIMIT_WHEEL_CHUNKS 4096
+
+static inline unsigned long *
+wheel_slot(const struct xt_bpflimit_htable *ht, unsigned long slot)
+{
+	return ht->wheel.map + BITS_TO_LONGS(ht->wheel.chunks) *
+	       (slot & (ht->wheel.slots - 1));
+}
+
+/* Slots are counted from the next one gc will go through, so this only
+ * compares jiffies and does not mind wraparound.  It races with gc
+ * moving on, which at worst costs an entry one slot of lifetime.
+ * The furthest slot is one short of a full turn: done + slots is the
+ * map gc may be scanning right now, and a bit set again there would
+ * keep that slot from ever getting through.
+ */
+static void wheel_mark(struct xt_bpflimit_htable *ht, u_int32_t hash,
+		       u32 expires)
+{
+	s32 wait = (s32)(expires - (u32)READ_ONCE(ht->wheel.due));
+	unsigned long slot = READ_ONCE(ht->wheel.done) + 1;
+	unsigned long *map;
+	unsigned int c = hash & (ht->wheel.chunks - 1);
+
+	/* beyond the wheel, the last slot looks again */
+	if (wait > 0)
+		slot += min_t(unsigned long,
+			      DIV_ROUND_UP(wait, ht->wheel.tick),
+			      ht->wheel.slots - 2);
+
+	map = wheel_slot(ht, slot);
+	if (!test_bit(c, map))
+		set_bit(c, map);
+}
+
+/* default entries per cpu kept ready for inserts */
+#define BPFLIMIT_MAG_SIZE 64
+
+/* Magazines together never hold more than the entries the table may
+ * still insert, so live plus cached entries stay within cfg.max and
+ * cfg.maxmem.
+ */
+static bool htable_mag_room(struct xt_bpflimit_htable *ht)
+{
+	s64 n = percpu_counter_read_positive(&ht->count) +
+		atomic_read(&ht->mag_stock);
+
+	if (n >= ht->cfg.max)
+		return false;
+	return !ht->cfg.maxmem ||
+	       (u64)(n + 1) * ht->entsize + READ_ONCE(ht->table_bytes) <=
+	       ht->cfg.maxmem;
+}
+
+static struct dsthash_ent *bpflimit_mag_pop(struct bpflimit_mag *mag)
+{
+	struct dsthash_ent *ent;
+
+	if (hlist_empty(&mag->free))
+		return NULL;
+	ent = hlist_entry(mag->free.first, struct dsthash_ent, node);
+	hlist_del(&ent->node);
+	mag->count--;
+	return ent;
+}
+
+/* Take an entry from this cpu's magazine.  A preallocated table takes
+ * from the other cpus' when this one ran dry, so a cpu that gets all
+ * the new keys can use the whole reserve.  Other magazines are only
+ * trylocked, this may run under a bucket lock.
+ */
+static struct dsthash_ent *dsthash_mag_get(struct xt_bpflimit_htable *ht)
+{
+	struct bpflimit_mag *mag = this_cpu_ptr(ht->mags);
+	struct dsthash_ent *ent;
+	unsigned int cpu;
+	bool refill;
+
+	spin_lock(&mag->lock);
+	ent = bpflimit_mag_pop(mag);
+	refill = !mag->low && mag->count < ht->mag_cap / 2;
+	if (refill)
+		mag->low = true;
+	spin_unlock(&mag->lock);
+
+	if (refill)
+		queue_work(system_unbound_wq, &ht->mag_work);
+
+	if (ent == NULL && ht->cfg.mode & XT_BPFLIMIT_PREALLOC) {
+		for_each_possible_cpu(cpu) {
+			struct bpflimit_mag *other = per_cpu_ptr(ht->mags, cpu);
+
+			if (other == mag || !READ_ONCE(other->count) ||
+			    !spin_trylock(&other->lock))
+				continue;
+			ent = bpflimit_mag_pop(other);
+			spin_unlock(&other->lock);
+			if (ent)
+				break;
+		}
+	}
+
+	if (ent)
+		atomic_dec(&ht->mag_stock);
+	return ent;
+}
+
+/* when the magazines are empty, never with a bucket lock held */
+static struct dsthash_ent *dsthash_slab_get(struct xt_bpflimit_htable *ht)
+{
+	struct mem_cgroup *old = htable_memcg_enter(ht);
+	struct dsthash_ent *ent;
+
+	ent = kmem_cache_alloc(ht->cachep, GFP_ATOMIC);
+	htable_memcg_exit(old);
+	return ent;
+}
+
+/* give back an entry that was never published, or whose grace period
+ * is over */
+static void dsthash_mag_put(struct xt_bpflimit_htable *ht,
+			    struct dsthash_ent *ent)
+{
+	struct bpflimit_mag *mag = this_cpu_ptr(ht->mags);
+
+	spin_lock(&mag->lock);
+	if (mag->count < ht->mag_cap && htable_mag_room(ht)) {
+		hlist_add_head(&ent->node, &mag->free);
+		mag->count++;
+		atomic_inc(&ht->mag_stock);
+		ent = NULL;
+	}
+	spin_unlock(&mag->lock);
+
+	if (ent)
+		kmem_cache_free(ht->cachep, ent);
+}
+
+/* The per-cpu count may lag by a batch per cpu, which is fine for a
+ * soft limit and keeps inserts on different cpus independent.  Entries
+ * waiting in magazines count against cfg.maxmem like live ones; an
+ * insert only needs a new one when they are all gone.
+ */
+static bool htable_full(struct xt_bpflimit_htable *ht)
+{
+	s64 count = percpu_counter_read_positive(&ht->count);
+	int stock = atomic_read(&ht->mag_stock);
+
+	if (ht->cfg.max && count >= ht->cfg.max)
+		return true;
+	return ht->cfg.maxmem &&
+	       (u64)(count + max(stock, 1)) * ht->entsize +
+	       READ_ONCE(ht->table_bytes) > ht->cfg.maxmem;
+}
+
+/* A key seen once lives only for the probation time, most of those
+ * never come back.  Its next packet refreshes it to the full expire.
+ */
+static u32 dsthash_ttl(const struct xt_bpflimit_htable *ht,
+		       const struct dsthash_dst *dst, u32 spent)
+{
+	if (ht->cfg.probation && spent == 0 && !dsthash_is_parent(ht, dst))
+		return ht->cfg.probation;
+	return ht->cfg.expire;
+}
+
+/* allocate dsthash_ent, initialize dst and rate state, put in htable.
+ * The entry is fully set up before it is published, so lockless users
+ * never see it half initialized.  If another cpu won the race to
+ * create it, the existing entry is returned instead.  @spent packets
+ * were already let through by the admission sketch.
+ * A new child takes over the reference on @parent, otherwise it is
+ * dropped.  Looking up an aggregate takes a reference on it.
+ */
 static struct dsthash_ent *
 dsthash_alloc_init(struct xt_bpflimit_htable *ht,
-		   const struct dsthash_dst *dst, bool *race)
+		   const struct dsthash_dst *dst, u_int32_t hash,
+		   u64 now, u32 spent, struct dsthash_ent *parent,
+		   int revision)
 {
-	struct dsthash_ent *ent;
+	spinlock_t *lock = dsthash_lock(ht, hash);
+	struct dsthash_table *t, *future;
+	struct dsthash_ent *ent, *new = NULL;
+
+again:
+	spin_lock(lock);
+
+	/* While a resize is under way the key may sit in either table and
+	 * new entries go to the future one.  future is read first: the
+	 * resize publishes the new table before it clears future.
+	 */
+	future = rcu_dereference_bh(ht->future);
+	smp_rmb();
+	t = rcu_dereference_bh(ht->table);
 
-	spin_lock(&ht->lock);
+	/* an expired entry of this key is replaced like gc would */
+	dsthash_reap(ht, t, hash, NULL);
+	if (future != NULL)
+		dsthash_reap(ht, future, hash, NULL);
 
 	/* Two or more packets may race to create the same entry in the
 	 * hashtable, double check if this packet lost race.
 	 */
-	ent = dsthash_find(ht, dst);
+	ent = dsthash_find(ht, t, dst, hash);
+	if (ent == NULL && future != NULL)
+		ent = dsthash_find(ht, future, dst, hash);
 	if (ent != NULL) {
-		spin_unlock(&ht->lock);
-		*race = true;
+		/* gc only frees aggregates without children under this lock */
+		if (dsthash_is_parent(ht, dst))
+			atomic_inc(&ent->children);
+		spin_unlock(lock);
+		if (parent)
+			atomic_dec(&parent->children);
+		if (new)
+			dsthash_mag_put(ht, new);
 		return ent;
 	}
 
-	/* initialize hash with random val at the time we allocate
-	 * the first hashtable entry */
-	if (unlikely(!ht->rnd_initialized)) {
-		get_random_bytes(&ht->rnd, sizeof(ht->rnd));
-		ht->rnd_initialized = true;
-	}
-
-	if (ht->cfg.max && ht->count >= ht->cfg.max) {
+	if (htable_full(ht) &&
+	    !(ht->cfg.mode & XT_BPFLIMIT_EVICT &&
+	      dsthash_evict(ht, future ? future : t, hash))) {
 		/* FIXME: do something. question is what.. */
-		net_err_ratelimited("max count of %u reached\n", ht->cfg.max);
+		if (ht->cfg.maxmem)
+			net_err_ratelimited("max count of %u or %llu bytes reached\n",
+					    ht->cfg.max, ht->cfg.maxmem);
+		else
+			net_err_ratelimited("max count of %u reached\n",
+					    ht->cfg.max);
 		ent = NULL;
-	} else
-		ent = kmem_cache_alloc(bpflimit_cachep, GFP_ATOMIC);
+	} else {
+		/* only now that the insert is certain */
+		if (new == NULL)
+			new = dsthash_mag_get(ht);
+		if (new == NULL) {
+			spin_unlock(lock);
+			new = dsthash_slab_get(ht);
+			if (new != NULL)
+				goto again;
+			if (parent)
+				atomic_dec(&parent->children);
+			return NULL;
+		}
+		ent = new;
+		new = NULL;
+	}
 	if (ent) {
-		memcpy(&ent->dst, dst, sizeof(ent->dst));
-		spin_lock_init(&ent->lock);
+		/* unused key fields read back as zero in the proc file */
+		memset(&ent->dst, 0, ht->keylen);
+		memcpy((void *)dsthash_key(ht, &ent->dst),
+		       dsthash_key(ht, dst), ht->keywords * sizeof(u32));
+		spin_lock_init(&ent->rateinfo.lock);
+		ent->gen = READ_ONCE(ht->gen);
+		ent->expires = bpflimit_stamp +
+			msecs_to_jiffies(dsthash_ttl(ht, dst, spent));
+		ent->rateinfo.rate_id = 0;
+		rateinfo_init(ent, ht, now, spent, revision);
+		wheel_mark(ht, hash, ent->expires);
+		if (dsthash_is_parent(ht, dst)) {
+			atomic_set(&ent->children, 1);
+		} else {
+			ent->parent = parent;
+			parent = NULL;
+		}
 
-		spin_lock(&ent->lock);
-		hlist_add_head_rcu(&ent->node, &ht->hash[hash_dst(ht, dst)]);
-		ht->count++;
+		hlist_add_head_rcu(&ent->node,
+				   dsthash_bucket(future ? future : t, hash));
+		percpu_counter_inc(&ht->count);
 	}
-	spin_unlock(&ht->lock);
+	spin_unlock(lock);
+
+	if (parent)
+		atomic_dec(&parent->children);
+	if (new)
+		dsthash_mag_put(ht, new);
 	return ent;
 }
 
+/* the htable may be gone by the time this runs, so it does not look
+ * at it */
 static void dsthash_free_rcu(struct rcu_head *head)
 {
 	struct dsthash_ent *ent = container_of(head, struct dsthash_ent, rcu);
@@ -337,171 +972,1219 @@ static void dsthash_free_rcu(struct rcu_head *head)
 	kmem_cache_free(bpflimit_cachep, ent);
 }
 
+/* A preallocated table keeps its reserve through churn: freed entries
+ * go back to a magazine while there is room.  htable_destroy() waits
+ * for these before it lets go of the table.
+ */
+static void dsthash_free_rcu_mag(struct rcu_head *head)
+{
+	struct dsthash_ent *ent = container_of(head, struct dsthash_ent, rcu);
+
+	dsthash_mag_put(ent->ht, ent);
+}
+
 static inline void
-dsthash_free(struct xt_bpflimit_htable *ht, struct dsthash_ent *ent)
+dsthash_drop(struct xt_bpflimit_htable *ht, struct dsthash_ent *ent,
+	     bool reuse)
 {
+	/* packets still charging it hold off its rcu callback */
+	if (ht->cfg.mode & XT_BPFLIMIT_PARENT &&
+	    !dsthash_is_parent(ht, &ent->dst))
+		atomic_dec(&ent->parent->children);
 	hlist_del_rcu(&ent->node);
-	call_rcu(&ent->rcu, dsthash_free_rcu);
-	ht->count--;
+	if (reuse) {
+		ent->ht = ht;
+		call_rcu(&ent->rcu, dsthash_free_rcu_mag);
+	} else {
+		call_rcu(&ent->rcu, dsthash_free_rcu);
+	}
+	percpu_counter_dec(&ht->count);
+}
+
+static inline void
+dsthash_free(struct xt_bpflimit_htable *ht, struct dsthash_ent *ent)
+{
+	dsthash_drop(ht, ent, ht->cfg.mode & XT_BPFLIMIT_PREALLOC);
+}
+
+/* Keys without an entry are counted in a count-min sketch and only get
+ * one once their estimate reaches cfg.admit, so a flood of one-packet
+ * sources never allocates.  Every gc run each counter leaks a packet
+ * per interval of the rate since the last one, so a counter is what a
+ * key sent beyond the rate, as a bucket of admit packets would see it.
+ * A key at or below the rate passes, one above it gets its entry.
+ */
+static u32 cms_add(struct xt_bpflimit_htable *ht, u_int32_t hash)
+{
+	u32 est = U32_MAX;
+	unsigned int i;
+
+	for (i = 0; i < BPFLIMIT_CMS_DEPTH; i++) {
+		atomic_t *row = ht->cms + (i << ht->cms_bits);
+		u32 n = hash_32(hash ^ ht->cms_seed[i], ht->cms_bits);
+
+		est = min_t(u32, est, atomic_inc_return(&row[n]));
+	}
+	return est;
+}
+
+static void cms_clear(struct xt_bpflimit_htable *ht)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < BPFLIMIT_CMS_DEPTH; i++) {
+		atomic_t *row = ht->cms + (i << ht->cms_bits);
+
+		for (j = 0; j < (1U << ht->cms_bits); j++)
+			atomic_set(&row[j], 0);
+		cond_resched();
+	}
+}
+
+static void cms_decay(struct xt_bpflimit_htable *ht)
+{
+	u64 cost = user2ns(ht->cfg.avg);
+	u64 n = div64_u64(bpflimit_clock(ht) - ht->cms_drained, cost);
+	unsigned int i, j;
+	int leak;
+
+	if (n == 0)
+		return;
+	/* the remainder leaks on the next run */
+	ht->cms_drained += n * cost;
+	leak = min_t(u64, n, INT_MAX);
+
+	for (i = 0; i < BPFLIMIT_CMS_DEPTH; i++) {
+		atomic_t *row = ht->cms + (i << ht->cms_bits);
+
+		/* only this takes away, packets adding meanwhile are kept */
+		for (j = 0; j < (1U << ht->cms_bits); j++) {
+			int v = atomic_read(&row[j]);
+
+			if (v)
+				atomic_sub(min(v, leak), &row[j]);
+		}
+		cond_resched();
+	}
+}
+
+/* buckets looked at for a victim when the table is full */
+#define BPFLIMIT_EVICT_PROBES 4
+
+/* pinned keys and aggregates with children are never reclaimed */
+static bool dsthash_busy(const struct xt_bpflimit_htable *ht,
+			 const struct dsthash_ent *ent)
+{
+	if (dsthash_is_parent(ht, &ent->dst))
+		return atomic_read(&ent->children);
+	return bpflimit_can_pin(ht) && READ_ONCE(ent->rateinfo.rate_id);
+}
+
+static struct dsthash_ent *
+dsthash_oldest(const struct xt_bpflimit_htable *ht,
+	       const struct dsthash_table *t, unsigned int bucket)
+{
+	struct dsthash_ent *ent, *victim = NULL;
+
+	hlist_for_each_entry(ent, &t->hash[bucket], node) {
+		/* pinned keys stay, aggregates go with their last child */
+		if (dsthash_busy(ht, ent))
+			continue;
+		if (victim == NULL || stamp_before(ent->expires, victim->expires))
+			victim = ent;
+	}
+	return victim;
+}
+
+/* XT_BPFLIMIT_EVICT: make room by dropping the entry closest to expiry
+ * in the target bucket, or failing that in one of the next few.  Other
+ * stripes are only trylocked, so a full table costs a bounded amount
+ * of work per insert and never waits on another cpu.
+ * Called with the stripe lock of @hash held.
+ */
+static bool dsthash_evict(struct xt_bpflimit_htable *ht,
+			  struct dsthash_table *t, u_int32_t hash)
+{
+	spinlock_t *held = dsthash_lock(ht, hash);
+	unsigned int i, bucket = hash & (t->size - 1);
+
+	for (i = 0; i < BPFLIMIT_EVICT_PROBES; i++) {
+		spinlock_t *lock = dsthash_lock(ht, bucket);
+		struct dsthash_ent *victim = NULL;
+
+		if (!hlist_empty(&t->hash[bucket]) &&
+		    (lock == held || spin_trylock(lock))) {
+			victim = dsthash_oldest(ht, t, bucket);
+			if (victim)
+				dsthash_free(ht, victim);
+			if (lock != held)
+				spin_unlock(lock);
+		}
+		if (victim)
+			return true;
+
+		if (++bucket == t->size)
+			bucket = 0;
+	}
+	return false;
+}
+static void bpflimit_gc_kick(struct bpflimit_net *bpflimit_net,
+			     unsigned long due);
+static void htable_put(struct xt_bpflimit_htable *hinfo);
+static int htable_shrinker_init(struct xt_bpflimit_htable *ht);
+static void htable_shrinker_free(struct xt_bpflimit_htable *ht);
+
+/* Top up magazines from process context.  With @all every cpu is
+ * filled, otherwise only the ones that asked for it.  Either way no
+ * further than cfg.max less the live entries.
+ */
+static int htable_mag_fill(struct xt_bpflimit_htable *ht, bool all)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct bpflimit_mag *mag = per_cpu_ptr(ht->mags, cpu);
+		struct dsthash_ent *ent;
+		struct mem_cgroup *old;
+
+		if (!all && !READ_ONCE(mag->low))
+			continue;
+
+		for (;;) {
+			if (!htable_mag_room(ht)) {
+				spin_lock_bh(&mag->lock);
+				mag->low = false;
+				spin_unlock_bh(&mag->lock);
+				break;
+			}
+
+			old = htable_memcg_enter(ht);
+			ent = kmem_cache_alloc(ht->cachep, GFP_KERNEL);
+			htable_memcg_exit(old);
+			if (ent == NULL) {
+				/* let the next insert ask again */
+				spin_lock_bh(&mag->lock);
+				mag->low = false;
+				spin_unlock_bh(&mag->lock);
+				return -ENOMEM;
+			}
+
+			spin_lock_bh(&mag->lock);
+			if (mag->count < ht->mag_cap) {
+				hlist_add_head(&ent->node, &mag->free);
+				mag->count++;
+				atomic_inc(&ht->mag_stock);
+				ent = NULL;
+			} else {
+				mag->low = false;
+			}
+			spin_unlock_bh(&mag->lock);
+
+			if (ent) {
+				kmem_cache_free(ht->cachep, ent);
+				break;
+			}
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+static void htable_mag_refill(struct work_struct *work)
+{
+	struct xt_bpflimit_htable *ht;
+
+	ht = container_of(work, struct xt_bpflimit_htable, mag_work);
+	htable_mag_fill(ht, false);
+}
+
+static void htable_mag_drain(struct xt_bpflimit_htable *ht)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct bpflimit_mag *mag = per_cpu_ptr(ht->mags, cpu);
+		struct dsthash_ent *ent;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(ent, n, &mag->free, node)
+			kmem_cache_free(ht->cachep, ent);
+	}
+	free_percpu(ht->mags);
+}
+
+static int htable_mag_init(struct xt_bpflimit_htable *ht)
+{
+	unsigned int cpu;
+
+	ht->mags = alloc_percpu(struct bpflimit_mag);
+	if (ht->mags == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct bpflimit_mag *mag = per_cpu_ptr(ht->mags, cpu);
+
+		spin_lock_init(&mag->lock);
+		mag->count = 0;
+		mag->low = false;
+		INIT_HLIST_HEAD(&mag->free);
+	}
+	INIT_WORK(&ht->mag_work, htable_mag_refill);
+	atomic_set(&ht->mag_stock, 0);
+
+	/* reserve the whole entry budget up front, spread over the cpus */
+	if (ht->cfg.mode & XT_BPFLIMIT_PREALLOC) {
+		u32 max = ht->cfg.max;
+
+		if (ht->cfg.maxmem)
+			max = min_t(u64, max,
+				    div_u64(ht->cfg.maxmem, ht->entsize));
+		ht->mag_cap = DIV_ROUND_UP(max, num_possible_cpus());
+		if (htable_mag_fill(ht, true)) {
+			htable_mag_drain(ht);
+			return -ENOMEM;
+		}
+	} else {
+		ht->mag_cap = BPFLIMIT_MAG_SIZE;
+	}
+	return 0;
+}
+
+static void key_span(unsigned int *lo, unsigned int *hi,
+		     unsigned int off, unsigned int len)
+{
+	*lo = min(*lo, round_down(off, sizeof(u32)));
+	*hi = max(*hi, round_up(off + len, sizeof(u32)));
+}
+
+/* narrow hashing and comparison down to the fields cfg.mode uses */
+static void htable_key_init(struct xt_bpflimit_htable *hinfo)
+{
+	u32 mode = hinfo->cfg.mode;
+	unsigned int lo = hinfo->keylen, hi = 0;
+	unsigned int addrlen;
+
+	addrlen = (hinfo->keylen - offsetof(struct dsthash_dst, ip)) / 2;
+
+	/* or carries the DSTHASH_PARENT tag instead */
+	if (mode & (XT_BPFLIMIT_HASH_BPF | XT_BPFLIMIT_PARENT))
+		key_span(&lo, &hi, offsetof(struct dsthash_dst, bpf),
+			 sizeof(__u32));
+	if (mode & XT_BPFLIMIT_HASH_SPT)
+		key_span(&lo, &hi, offsetof(struct dsthash_dst, src_port),
+			 sizeof(__be16));
+	if (mode & XT_BPFLIMIT_HASH_DPT)
+		key_span(&lo, &hi, offsetof(struct dsthash_dst, dst_port),
+			 sizeof(__be16));
+	/* both families keep src then dst at the start of the union */
+	if (mode & XT_BPFLIMIT_HASH_SIP)
+		key_span(&lo, &hi, offsetof(struct dsthash_dst, ip), addrlen);
+	if (mode & XT_BPFLIMIT_HASH_DIP)
+		key_span(&lo, &hi, offsetof(struct dsthash_dst, ip) + addrlen,
+			 addrlen);
+
+	if (hi == 0)
+		lo = 0;
+	hinfo->keyoff = lo;
+	hinfo->keywords = (hi - lo) / sizeof(u32);
+}
+
+static int htable_create(struct net *net, struct bpflimit_cfg4 *cfg,
+			 const char *name, const char *bpf_path,
+			 u_int8_t family,
+			 struct xt_bpflimit_htable **out_hinfo,
+			 int revision)
+{
+	struct bpflimit_net *bpflimit_net = bpflimit_pernet(net);
+	struct xt_bpflimit_htable *hinfo;
+	unsigned int size, keys;
+	unsigned long nr_pages;
+	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
+		const struct file_operations *ops;
+		nr_pages = totalram_pages;
+	#else
+		const struct seq_operations *ops;
+		nr_pages = totalram_pages();
+	#endif
+	
+	int ret;
+
+	if (cfg->size) {
+		size = cfg->size;
+	} else {
+		size = (nr_pages << PAGE_SHIFT) / 16384 /
+		       sizeof(struct hlist_head);
+		if (nr_pages > 1024 * 1024 * 1024 / PAGE_SIZE)
+			size = 8192;
+		if (size < 16)
+			size = 16;
+	}
+	/* the table grows and shrinks from here, but never below it */
+	size = roundup_pow_of_two(size);
+	if (cfg->maxmem && dsthash_table_bytes(size) > cfg->maxmem)
+		return -EINVAL;
+
+	hinfo = kzalloc(sizeof(struct xt_bpflimit_htable), GFP_KERNEL);
+	if (hinfo == NULL)
+		return -ENOMEM;
+	*out_hinfo = hinfo;
+
+	/* copy match config into hashtable config */
+	ret = cfg_copy(&hinfo->cfg, (void *)cfg, 4);
+	if (ret) {
+		kfree(hinfo);
+		return ret;
+	}
+
+	hinfo->prog = NULL;
+	if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_BPF) {
+		hinfo->prog = bpf_prog_get_type_path(bpf_path,
+						     BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(hinfo->prog)) {
+			ret = PTR_ERR(hinfo->prog);
+			kfree(hinfo);
+			return ret;
+		}
+	}
+
+	hinfo->cfg.size = size;
+	hinfo->revision = revision;
+	htable_memcg_init(hinfo);
+	mutex_init(&hinfo->rates_lock);
+	hinfo->ns = revision >= 4;
+	htable_rateinfo_init(hinfo, revision);
+	if (hinfo->cfg.max == 0)
+		hinfo->cfg.max = 8 * hinfo->cfg.size;
+	else if (hinfo->cfg.max < hinfo->cfg.size)
+		hinfo->cfg.max = hinfo->cfg.size;
+
+	/* sketch tables have no buckets, size is the sketch width */
+	if (!(hinfo->cfg.mode & XT_BPFLIMIT_SKETCH)) {
+		struct dsthash_table *t = dsthash_table_alloc(hinfo, size);
+
+		if (t == NULL) {
+			ret = -ENOMEM;
+			goto err_prog;
+		}
+		RCU_INIT_POINTER(hinfo->table, t);
+		hinfo->table_bytes = dsthash_table_bytes(size);
+	}
+
+	hinfo->use = 1;
+	hinfo->family = family;
+	hinfo->cachep = bpflimit_cachep;
+#if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
+	if (family == NFPROTO_IPV6)
+		hinfo->keylen = DSTHASH_KEYLEN_IPV6;
+	else
+#endif
+		hinfo->keylen = DSTHASH_KEYLEN_IPV4;
+	hinfo->entsize = kmem_cache_size(hinfo->cachep);
+	htable_key_init(hinfo);
+	get_random_bytes(&hinfo->rnd, sizeof(hinfo->rnd));
+
+	hinfo->cms = NULL;
+	hinfo->cells = NULL;
+	/* The GCRA sketch is htable-size wide.  The admission sketch sees
+	 * the keys waiting for an entry, up to as many as the table may
+	 * grow to hold, and resizes never touch it, so size it for max.
+	 */
+	keys = hinfo->cfg.size;
+	if (hinfo->cfg.admit) {
+		keys = hinfo->cfg.max;
+		if (hinfo->cfg.maxmem)
+			keys = min_t(u64, keys, div_u64(hinfo->cfg.maxmem,
+							hinfo->entsize));
+	}
+	hinfo->cms_bits = max_t(unsigned int, BPFLIMIT_CMS_MIN_BITS,
+				order_base_2(keys));
+	get_random_bytes(hinfo->cms_seed, sizeof(hinfo->cms_seed));
+	if (hinfo->cfg.admit) {
+		hinfo->cms = vzalloc((sizeof(atomic_t) * BPFLIMIT_CMS_DEPTH) <<
+				     hinfo->cms_bits);
+		if (hinfo->cms == NULL) {
+			ret = -ENOMEM;
+			goto err_table;
+		}
+		hinfo->cms_drained = bpflimit_clock(hinfo);
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_SKETCH) {
+		unsigned long n = BPFLIMIT_CMS_DEPTH << hinfo->cms_bits;
+		u64 now = bpflimit_clock(hinfo);
+
+		hinfo->cells = vmalloc(sizeof(atomic64_t) * n);
+		if (hinfo->cells == NULL) {
+			ret = -ENOMEM;
+			goto err_table;
+		}
+		while (n--)
+			atomic64_set(&hinfo->cells[n], now);
+	}
+
+	/* nothing ever expires from a sketch */
+	if (!hinfo->cells) {
+		hinfo->wheel.tick = max(msecs_to_jiffies(hinfo->cfg.gc_interval),
+					1UL);
+		hinfo->wheel.slots = min_t(unsigned int, BPFLIMIT_WHEEL_SLOTS,
+			roundup_pow_of_two(DIV_ROUND_UP(hinfo->cfg.expire,
+						hinfo->cfg.gc_interval) + 2));
+		hinfo->wheel.chunks = min_t(unsigned int, BPFLIMIT_WHEEL_CHUNKS,
+					    hinfo->cfg.size);
+		hinfo->wheel.done = 0;
+		hinfo->wheel.due = jiffies + hinfo->wheel.tick;
+		hinfo->wheel.map = kcalloc(hinfo->wheel.slots *
+					   BITS_TO_LONGS(hinfo->wheel.chunks),
+					   sizeof(unsigned long), GFP_KERNEL);
+		if (hinfo->wheel.map == NULL) {
+			ret = -ENOMEM;
+			goto err_cms;
+		}
+	}
+
+	ret = percpu_counter_init(&hinfo->count, 0, GFP_KERNEL);
+	if (ret)
+		goto err_cms;
+
+	/* a handful of stripes per cpu is enough to make collisions
+	 * between concurrent inserts unlikely.  A sketch has no entries
+	 * to lock or to keep in magazines. */
+	if (!hinfo->cells) {
+		ret = alloc_bucket_spinlocks(&hinfo->locks, &hinfo->lock_mask,
+					     hinfo->cfg.size,
+					     BPFLIMIT_LOCKS_PER_CPU,
+					     GFP_KERNEL);
+		if (ret)
+			goto err_count;
+
+		ret = htable_mag_init(hinfo);
+		if (ret)
+			goto err_locks;
+	}
+
+	/* the ceiling starts out full, like a new entry */
+	if (hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL) {
+		hinfo->global.local = alloc_percpu(u64);
+		if (hinfo->global.local == NULL) {
+			ret = -ENOMEM;
+			goto err_mags;
+		}
+		atomic64_set(&hinfo->global.credit, hinfo->global.credit_cap);
+		atomic64_set(&hinfo->global.prev, bpflimit_clock(hinfo));
+	}
+
+	hinfo->name = kstrdup(name, GFP_KERNEL);
+	if (!hinfo->name) {
+		ret = -ENOMEM;
+		goto err_global;
+	}
+
+	if (hinfo->cfg.mode & XT_BPFLIMIT_SHRINK) {
+		ret = htable_shrinker_init(hinfo);
+		if (ret)
+			goto err_name;
+	}
+
+	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
+	switch (revision) {
+	case 1:
+		ops = &dl_file_ops_v1;
+		break;
+	case 2:
+		ops = &dl_file_ops_v2;
+		break;
+	default:
+		ops = &dl_file_ops;
+	}
+	#else
+	switch (revision) {
+	case 1:
+		ops = &dl_seq_ops_v1;
+		break;
+	case 2:
+		ops = &dl_seq_ops_v2;
+		break;
+	default:
+		ops = &dl_seq_ops;
+	}
+	#endif
+
+	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
+	hinfo->pde = proc_create_data(name, revision >= 4 ? 0644 : 0,
+		(family == NFPROTO_IPV4) ?
+		bpflimit_net->ipt_bpflimit : bpflimit_net->ip6t_bpflimit,
+		ops, hinfo);
+	#else
+	if (revision >= 4)
+		hinfo->pde = proc_create_data(name, 0644,
+			(family == NFPROTO_IPV4) ?
+			bpflimit_net->ipt_bpflimit : bpflimit_net->ip6t_bpflimit,
+			&dl_proc_ops, hinfo);
+	else
+		hinfo->pde = proc_create_seq_data(name, 0,
+			(family == NFPROTO_IPV4) ?
+			bpflimit_net->ipt_bpflimit : bpflimit_net->ip6t_bpflimit,
+			ops, hinfo);
+	#endif
+	if (hinfo->pde == NULL) {
+		ret = -ENOMEM;
+		goto err_shrinker;
+	}
+	hinfo->net = net;
+
+	hlist_add_head(&hinfo->node, &bpflimit_net->htables);
+
+	/* nothing ever expires from a sketch */
+	hinfo->gc_due = jiffies + msecs_to_jiffies(hinfo->cfg.gc_interval);
+	if (!hinfo->cells)
+		bpflimit_gc_kick(bpflimit_net, hinfo->gc_due);
+
+	return 0;
+
+err_shrinker:
+	if (hinfo->cfg.mode & XT_BPFLIMIT_SHRINK)
+		htable_shrinker_free(hinfo);
+err_name:
+	kfree(hinfo->name);
+err_global:
+	free_percpu(hinfo->global.local);
+err_mags:
+	if (!hinfo->cells)
+		htable_mag_drain(hinfo);
+err_locks:
+	free_bucket_spinlocks(hinfo->locks);
+err_count:
+	percpu_counter_destroy(&hinfo->count);
+err_cms:
+	kfree(hinfo->wheel.map);
+	vfree(hinfo->cells);
+	vfree(hinfo->cms);
+err_table:
+	kvfree(rcu_dereference_protected(hinfo->table, 1));
+err_prog:
+	if (hinfo->prog)
+		bpf_prog_put(hinfo->prog);
+	htable_memcg_put(hinfo);
+	kfree(hinfo);
+	return ret;
+}
+
+static bool select_all(const struct xt_bpflimit_htable *ht,
+		       const struct dsthash_ent *he)
+{
+	return true;
+}
+
+/* children go first, so their aggregates are still around to drop */
+static bool select_child(const struct xt_bpflimit_htable *ht,
+			 const struct dsthash_ent *he)
+{
+	return !dsthash_is_parent(ht, &he->dst);
+}
+
+static bool select_gc(const struct xt_bpflimit_htable *ht,
+		      const struct dsthash_ent *he)
+{
+	if (dsthash_stale(ht, he))
+		/* flushed, aggregates wait for their children */
+		return !dsthash_is_parent(ht, &he->dst) ||
+		       !atomic_read(&he->children);
+	return !stamp_before(bpflimit_stamp, he->expires) &&
+	       !dsthash_busy(ht, he);
+}
+
+/* Free what has expired in the bucket of @hash, except @keep, so
+ * chains do not wait for gc to get short again.  Called with the
+ * stripe lock of @hash held.
+ */
+static void dsthash_reap(struct xt_bpflimit_htable *ht,
+			 struct dsthash_table *t, u_int32_t hash,
+			 const struct dsthash_ent *keep)
+{
+	struct dsthash_ent *ent;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_safe(ent, n, dsthash_bucket(t, hash), node)
+		if (ent != keep && select_gc(ht, ent))
+			dsthash_free(ht, ent);
+}
+
+/* dsthash_find() for packets.  Expired entries it walked past are
+ * reaped on the way out if the stripe is free; a packet never waits
+ * for the lock just to clean up.
+ */
+static struct dsthash_ent *
+dsthash_lookup(struct xt_bpflimit_htable *ht, struct dsthash_table *t,
+	       const struct dsthash_dst *dst, u_int32_t hash)
+{
+	struct dsthash_ent *ent, *found = NULL;
+	bool stale = false;
+
+	hlist_for_each_entry_rcu(ent, dsthash_bucket(t, hash), node) {
+		if (dst_cmp(ht, ent, dst) && !dsthash_stale(ht, ent)) {
+			found = ent;
+			break;
+		}
+		if (!stale && select_gc(ht, ent))
+			stale = true;
+	}
+
+	if (stale) {
+		spinlock_t *lock = dsthash_lock(ht, hash);
+
+		if (spin_trylock(lock)) {
+			dsthash_reap(ht, t, hash, found);
+			spin_unlock(lock);
+		}
+	}
+	return found;
+}
+
+/* Keys a resize already moved are found in future without the lock,
+ * so packets only take the slow path for the entries in flight.
+ * future is read first: by the time it is cleared, table is the new
+ * one.
+ */
+static struct dsthash_ent *
+dsthash_lookup_rcu(struct xt_bpflimit_htable *ht,
+		   const struct dsthash_dst *dst, u_int32_t hash)
+{
+	struct dsthash_table *future = rcu_dereference_bh(ht->future);
+	struct dsthash_ent *ent;
+
+	smp_rmb();
+	ent = dsthash_lookup(ht, rcu_dereference_bh(ht->table), dst, hash);
+	if (ent == NULL && future != NULL)
+		ent = dsthash_lookup(ht, future, dst, hash);
+	return ent;
+}
+
+static void htable_selective_cleanup(struct xt_bpflimit_htable *ht,
+			bool (*select)(const struct xt_bpflimit_htable *ht,
+				      const struct dsthash_ent *he))
+{
+	/* only gc work swaps tables and it is either us or stopped */
+	struct dsthash_table *t = rcu_dereference_protected(ht->table, 1);
+	unsigned int i;
+
+	if (t == NULL)
+		return;
+
+	for (i = 0; i < t->size; i++) {
+		spinlock_t *lock = dsthash_lock(ht, i);
+		struct dsthash_ent *dh;
+		struct hlist_node *n;
+
+		if (hlist_empty(&t->hash[i]))
+			continue;
+
+		spin_lock_bh(lock);
+		hlist_for_each_entry_safe(dh, n, &t->hash[i], node) {
+			if ((*select)(ht, dh))
+				dsthash_free(ht, dh);
+		}
+		spin_unlock_bh(lock);
+		cond_resched();
+	}
+}
+
+/* XT_BPFLIMIT_SHRINK: under memory pressure give back entries that
+ * saw no packet for a gc interval, on top of what gc would free.
+ * Pinned keys and aggregates with children stay.
+ */
+static bool select_shrink(const struct xt_bpflimit_htable *ht,
+			  const struct dsthash_ent *he)
+{
+	unsigned long idle = msecs_to_jiffies(min(ht->cfg.gc_interval,
+						  ht->cfg.expire));
+
+	if (select_gc(ht, he))
+		return true;
+	/* expires is the last packet plus cfg.expire */
+	return !dsthash_busy(ht, he) &&
+	       !stamp_before(bpflimit_stamp + msecs_to_jiffies(ht->cfg.expire) -
+			     idle, he->expires);
+}
+
+static inline struct xt_bpflimit_htable *htable_of(struct shrinker *s)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	return s->private_data;
+#else
+	return container_of(s, struct xt_bpflimit_htable, shrinker);
+#endif
+}
+
+static unsigned long htable_shrink_count(struct shrinker *s,
+					 struct shrink_control *sc)
+{
+	return percpu_counter_read_positive(&htable_of(s)->count);
+}
+
+/* Walks on from where the last call stopped, so repeated calls go
+ * round the table instead of picking on its first buckets.  Gc may be
+ * resizing meanwhile: the stripe lock of a bucket covers it in either
+ * table, and an old table is only freed after a grace period.
+ */
+static unsigned long htable_shrink_scan(struct shrinker *s,
+					struct shrink_control *sc)
+{
+	struct xt_bpflimit_htable *ht = htable_of(s);
+	unsigned long freed = 0, scanned = 0;
+	struct dsthash_table *t;
+	unsigned int i, n, max;
+
+	rcu_read_lock_bh();
+	t = rcu_dereference_bh(ht->table);
+	/* empty buckets are cheap, but not free */
+	max = min_t(unsigned long, t->size, sc->nr_to_scan * 8);
+	i = READ_ONCE(ht->shrink_pos);
+	for (n = 0; n < max && scanned < sc->nr_to_scan; n++, i++) {
+		unsigned int b = i & (t->size - 1);
+		spinlock_t *lock = dsthash_lock(ht, b);
+		struct dsthash_ent *dh;
+		struct hlist_node *next;
+
+		if (hlist_empty(&t->hash[b]))
+			continue;
+
+		spin_lock(lock);
+		hlist_for_each_entry_safe(dh, next, &t->hash[b], node) {
+			scanned++;
+			/* memory pressure, not back to the reserve */
+			if (select_shrink(ht, dh)) {
+				dsthash_drop(ht, dh, false);
+				freed++;
+			}
+		}
+		spin_unlock(lock);
+	}
+	WRITE_ONCE(ht->shrink_pos, i);
+	rcu_read_unlock_bh();
+
+	sc->nr_scanned = scanned;
+	return freed ? freed : SHRINK_STOP;
+}
+
+static int htable_shrinker_init(struct xt_bpflimit_htable *ht)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	ht->shrinker = shrinker_alloc(0, "xt_bpflimit-%s", ht->name);
+	if (ht->shrinker == NULL)
+		return -ENOMEM;
+	ht->shrinker->count_objects = htable_shrink_count;
+	ht->shrinker->scan_objects = htable_shrink_scan;
+	ht->shrinker->seeks = DEFAULT_SEEKS;
+	ht->shrinker->private_data = ht;
+	shrinker_register(ht->shrinker);
+	return 0;
+#else
+	ht->shrinker.count_objects = htable_shrink_count;
+	ht->shrinker.scan_objects = htable_shrink_scan;
+	ht->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return register_shrinker(&ht->shrinker, "xt_bpflimit-%s", ht->name);
+#else
+	return register_shrinker(&ht->shrinker);
+#endif
+#endif
+}
+
+static void htable_shrinker_free(struct xt_bpflimit_htable *ht)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	shrinker_free(ht->shrinker);
+#else
+	unregister_shrinker(&ht->shrinker);
+#endif
+}
+
+/* Move every entry to a table of @size buckets.  Lookups check both
+ * tables, but one that races with the move of its entry may still miss
+ * and fall back to dsthash_alloc_init(), which checks both under the
+ * stripe lock.
+ */
+static void htable_resize(struct xt_bpflimit_htable *ht, unsigned int size)
+{
+	struct dsthash_table *old = rcu_dereference_protected(ht->table, 1);
+	struct dsthash_table *new;
+	unsigned int i;
+
+	new = dsthash_table_alloc(ht, size);
+	if (new == NULL)
+		return;
+	WRITE_ONCE(ht->table_bytes, dsthash_table_bytes(old->size) +
+				    dsthash_table_bytes(size));
+
+	/* inserts see this once they hold a stripe we have not moved */
+	rcu_assign_pointer(ht->future, new);
+
+	for (i = 0; i < old->size; i++) {
+		spinlock_t *lock = dsthash_lock(ht, i);
+		struct dsthash_ent *dh;
+		struct hlist_node *n;
+
+		/* Always take the lock: an insert that holds it may have
+		 * read future before it was set and still be adding to
+		 * this bucket.  Once we had the lock, it sees future.
+		 */
+		spin_lock_bh(lock);
+		hlist_for_each_entry_safe(dh, n, &old->hash[i], node) {
+			hlist_del_rcu(&dh->node);
+			hlist_add_head_rcu(&dh->node,
+				dsthash_bucket(new, hash_key(ht, &dh->dst)));
+		}
+		spin_unlock_bh(lock);
+		cond_resched();
+	}
+
+	rcu_assign_pointer(ht->table, new);
+	smp_wmb();
+	RCU_INIT_POINTER(ht->future, NULL);
+
+	synchronize_rcu();
+	kvfree(old);
+	WRITE_ONCE(ht->table_bytes, dsthash_table_bytes(size));
+}
+
+/* keep chains short: grow past two entries per bucket, shrink below
+ * one per eight, between the initial size and room for cfg.max */
+static void htable_resize_check(struct xt_bpflimit_htable *ht)
+{
+	struct dsthash_table *t = rcu_dereference_protected(ht->table, 1);
+	/* max is a u32, its power of two may not be */
+	unsigned int max_size = roundup_pow_of_two(min_t(u32, ht->cfg.max,
+							 1U << 31));
+	s64 count = percpu_counter_sum_positive(&ht->count);
+	unsigned int size = t->size;
+
+	/* buckets get at most half of cfg.maxmem, entries the rest */
+	while (ht->cfg.maxmem && max_size > ht->cfg.size &&
+	       dsthash_table_bytes(max_size) > ht->cfg.maxmem / 2)
+		max_size /= 2;
+
+	if (count > 2 * (s64)size && size < max_size)
+		size = min_t(u64, roundup_pow_of_two(count), max_size);
+	else if (count < size / 8 && size > ht->cfg.size)
+		size = count ? max_t(u64, roundup_pow_of_two(count * 2),
+				     ht->cfg.size) : ht->cfg.size;
+
+	if (size != t->size)
+		htable_resize(ht, size);
+}
+
+/* free what is due in chunk @c, and mark it again for what is left */
+static unsigned int wheel_scan(struct xt_bpflimit_htable *ht, unsigned int c)
+{
+	struct dsthash_table *t = rcu_dereference_protected(ht->table, 1);
+	unsigned int i, freed = 0;
+	u32 next = 0;
+	bool left = false;
+
+	for (i = c; i < t->size; i += ht->wheel.chunks) {
+		spinlock_t *lock = dsthash_lock(ht, i);
+		struct dsthash_ent *dh;
+		struct hlist_node *n;
+
+		if (hlist_empty(&t->hash[i]))
+			continue;
+
+		spin_lock_bh(lock);
+		hlist_for_each_entry_safe(dh, n, &t->hash[i], node) {
+			if (select_gc(ht, dh)) {
+				dsthash_free(ht, dh);
+				freed++;
+				continue;
+			}
+			/* pinned keys are marked again once unpinned */
+			if (!dsthash_is_parent(ht, &dh->dst) &&
+			    dsthash_busy(ht, dh))
+				continue;
+			if (!left || stamp_before(dh->expires, next))
+				next = dh->expires;
+			left = true;
+		}
+		spin_unlock_bh(lock);
+	}
+
+	if (left)
+		wheel_mark(ht, c, next);
+	return freed;
 }
-static void htable_gc(struct work_struct *work);
 
-static int htable_create(struct net *net, struct bpflimit_cfg3 *cfg,
-			 const char *name, u_int8_t family,
-			 struct xt_bpflimit_htable **out_hinfo,
-			 int revision)
+/* scan the chunks set in @map between @first and @last, while the
+ * budget lasts */
+static unsigned int wheel_scan_range(struct xt_bpflimit_htable *ht,
+				     unsigned long *map, unsigned int first,
+				     unsigned int last, unsigned int *budget,
+				     unsigned int cost)
 {
-	struct bpflimit_net *bpflimit_net = bpflimit_pernet(net);
-	struct xt_bpflimit_htable *hinfo;
-	unsigned int size, i;
-	unsigned long nr_pages;
-	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
-		const struct file_operations *ops;
-		nr_pages = totalram_pages;
-	#else
-		const struct seq_operations *ops;
-		nr_pages = totalram_pages();
-	#endif
-	
-	int ret;
-
-	if (cfg->size) {
-		size = cfg->size;
-	} else {
-		size = (nr_pages << PAGE_SHIFT) / 16384 /
-		       sizeof(struct hlist_head);
-		if (nr_pages > 1024 * 1024 * 1024 / PAGE_SIZE)
-			size = 8192;
-		if (size < 16)
-			size = 16;
+	unsigned int c, freed = 0;
+
+	for (c = find_next_bit(map, last, first); c < last;
+	     c = find_next_bit(map, last, c + 1)) {
+		if (*budget < cost)
+			break;
+		*budget -= cost;
+		clear_bit(c, map);
+		freed += wheel_scan(ht, c);
+		cond_resched();
 	}
-	/* FIXME: don't use vmalloc() here or anywhere else -HW */
-	hinfo = vmalloc(sizeof(struct xt_bpflimit_htable) +
-	                sizeof(struct hlist_head) * size);
-	if (hinfo == NULL)
-		return -ENOMEM;
-	*out_hinfo = hinfo;
+	return freed;
+}
 
-	/* copy match config into hashtable config */
-	ret = cfg_copy(&hinfo->cfg, (void *)cfg, 3);
-	if (ret) {
-		vfree(hinfo);
-		return ret;
-	}
+/* Tables of this many buckets and up have a slot split over several
+ * workers.  Chunks never share a bucket, and the gc worker waits for
+ * all of them, so nothing else about the table changes meanwhile.
+ */
+#define BPFLIMIT_GC_PARALLEL (1U << 20)
+#define BPFLIMIT_GC_PARTS 8
 
-	hinfo->cfg.size = size;
-	if (hinfo->cfg.max == 0)
-		hinfo->cfg.max = 8 * hinfo->cfg.size;
-	else if (hinfo->cfg.max < hinfo->cfg.size)
-		hinfo->cfg.max = hinfo->cfg.size;
+struct bpflimit_gc_part {
+	struct work_struct work;
+	struct xt_bpflimit_htable *ht;
+	unsigned long *map;
+	unsigned int first, last;	/* chunks */
+	unsigned int budget, cost;	/* buckets */
+	unsigned int freed;
+};
 
-	for (i = 0; i < hinfo->cfg.size; i++)
-		INIT_HLIST_HEAD(&hinfo->hash[i]);
+static void wheel_part_work(struct work_struct *work)
+{
+	struct bpflimit_gc_part *part =
+		container_of(work, struct bpflimit_gc_part, work);
 
-	hinfo->use = 1;
-	hinfo->count = 0;
-	hinfo->family = family;
-	hinfo->rnd_initialized = false;
-	hinfo->name = kstrdup(name, GFP_KERNEL);
-	if (!hinfo->name) {
-		vfree(hinfo);
-		return -ENOMEM;
-	}
-	spin_lock_init(&hinfo->lock);
+	part->freed = wheel_scan_range(part->ht, part->map, part->first,
+				       part->last, &part->budget, part->cost);
+}
 
-	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
-	switch (revision) {
-	case 1:
-		ops = &dl_file_ops_v1;
-		break;
-	case 2:
-		ops = &dl_file_ops_v2;
-		break;
-	default:
-		ops = &dl_file_ops;
-	}
-	#else
-	switch (revision) {
-	case 1:
-		ops = &dl_seq_ops_v1;
-		break;
-	case 2:
-		ops = &dl_seq_ops_v2;
-		break;
-	default:
-		ops = &dl_seq_ops;
+/* The budget is shared out between the parts, and what they leave is
+ * handed back.  The first part runs right here.
+ */
+static unsigned int wheel_scan_parallel(struct xt_bpflimit_htable *ht,
+					unsigned long *map,
+					unsigned int *budget,
+					unsigned int cost)
+{
+	struct bpflimit_gc_part parts[BPFLIMIT_GC_PARTS];
+	unsigned int n = min_t(unsigned int, BPFLIMIT_GC_PARTS,
+			       num_online_cpus());
+	unsigned int i, step, share, freed = 0;
+
+	/* every part must be able to scan a chunk */
+	n = min3(n, ht->wheel.chunks, *budget / cost);
+	if (n == 0)
+		return 0;
+	step = ht->wheel.chunks / n;
+	share = *budget / n;
+	*budget -= share * n;
+	for (i = 0; i < n; i++) {
+		parts[i].ht = ht;
+		parts[i].map = map;
+		parts[i].first = i * step;
+		parts[i].last = i == n - 1 ? ht->wheel.chunks : (i + 1) * step;
+		parts[i].budget = share;
+		parts[i].cost = cost;
+		INIT_WORK_ONSTACK(&parts[i].work, wheel_part_work);
+		if (i)
+			queue_work(system_unbound_wq, &parts[i].work);
 	}
-	#endif
 
-	#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
-	hinfo->pde = proc_create_data(name, 0,
-		(family == NFPROTO_IPV4) ?
-		bpflimit_net->ipt_bpflimit : bpflimit_net->ip6t_bpflimit,
-		ops, hinfo);
-	#else
-	hinfo->pde = proc_create_seq_data(name, 0,
-		(family == NFPROTO_IPV4) ?
-		bpflimit_net->ipt_bpflimit : bpflimit_net->ip6t_bpflimit,
-		ops, hinfo);
-	#endif
-	if (hinfo->pde == NULL) {
-		kfree(hinfo->name);
-		vfree(hinfo);
-		return -ENOMEM;
+	wheel_part_work(&parts[0].work);
+	for (i = 0; i < n; i++) {
+		if (i)
+			flush_work(&parts[i].work);
+		destroy_work_on_stack(&parts[i].work);
+		freed += parts[i].freed;
+		*budget += parts[i].budget;
 	}
-	hinfo->net = net;
+	return freed;
+}
 
-	INIT_DEFERRABLE_WORK(&hinfo->gc_work, htable_gc);
-	queue_delayed_work(system_power_efficient_wq, &hinfo->gc_work,
-			   msecs_to_jiffies(hinfo->cfg.gc_interval));
+/* Go through the slots that are due, scanning at most @budget buckets.
+ * Returns true if it stopped short; the next run picks up the slot
+ * where this one left it.  A pass is timed over the runs that scan it,
+ * not the waits between them.
+ */
+static bool wheel_run(struct xt_bpflimit_htable *ht, unsigned int budget)
+{
+	unsigned int size = rcu_dereference_protected(ht->table, 1)->size;
+	unsigned int cost = max_t(unsigned int, 1, size / ht->wheel.chunks);
+	unsigned int n;
+
+	for (n = 0; n < ht->wheel.slots; n++) {
+		unsigned long *map;
+		bool more;
+		u64 start;
+
+		if (!ht->wheel.partial) {
+			if (!time_after_eq(jiffies, ht->wheel.due))
+				return false;
+			/* move on first, so inserts mark later slots */
+			WRITE_ONCE(ht->wheel.due,
+				   ht->wheel.due + ht->wheel.tick);
+			WRITE_ONCE(ht->wheel.done, ht->wheel.done + 1);
+			ht->wheel.partial = true;
+			ht->wheel.pass_ns = 0;
+			ht->wheel.pass_freed = 0;
+		}
 
-	hlist_add_head(&hinfo->node, &bpflimit_net->htables);
+		map = wheel_slot(ht, ht->wheel.done);
+		start = ktime_get_ns();
+		if (size >= BPFLIMIT_GC_PARALLEL && num_online_cpus() > 1) {
+			unsigned int left;
+
+			/* parts that ran dry may leave chunks to the rest */
+			do {
+				left = budget;
+				ht->wheel.pass_freed +=
+					wheel_scan_parallel(ht, map, &budget,
+							    cost);
+				more = find_first_bit(map, ht->wheel.chunks) <
+				       ht->wheel.chunks;
+			} while (more && budget != left);
+		} else {
+			ht->wheel.pass_freed +=
+				wheel_scan_range(ht, map, 0, ht->wheel.chunks,
+						 &budget, cost);
+			more = find_first_bit(map, ht->wheel.chunks) <
+			       ht->wheel.chunks;
+		}
+		ht->wheel.pass_ns += ktime_get_ns() - start;
+		if (more)
+			return true;
+
+		ht->wheel.partial = false;
+		WRITE_ONCE(ht->wheel.last_ns, ht->wheel.pass_ns);
+		WRITE_ONCE(ht->wheel.last_freed, ht->wheel.pass_freed);
+		if (ht->wheel.pass_ns > ht->wheel.max_ns)
+			WRITE_ONCE(ht->wheel.max_ns, ht->wheel.pass_ns);
+	}
 
-	return 0;
+	/* a gc run that came very late went through every slot */
+	if (time_after_eq(jiffies, ht->wheel.due))
+		WRITE_ONCE(ht->wheel.due, jiffies + ht->wheel.tick);
+	return false;
 }
 
-static bool select_all(const struct xt_bpflimit_htable *ht,
-		       const struct dsthash_ent *he)
+/* buckets one table may scan before the others get their turn */
+#define BPFLIMIT_GC_BUCKETS 16384
+
+static bool htable_gc(struct xt_bpflimit_htable *ht)
 {
-	return true;
+	if (wheel_run(ht, BPFLIMIT_GC_BUCKETS))
+		return true;
+
+	htable_resize_check(ht);
+	if (ht->cms)
+		cms_decay(ht);
+	return false;
 }
 
-static bool select_gc(const struct xt_bpflimit_htable *ht,
-		      const struct dsthash_ent *he)
+/* Tables are collected by one worker per netns rather than a timer
+ * each, so thousands of tables cost one wakeup per due batch.  It runs
+ * on the unbound workqueue, which keeps it to housekeeping cpus, and
+ * gives up the cpu after a slice; a large table is scanned a budget at
+ * a time, so it does not hold up the others either.
+ */
+#define BPFLIMIT_GC_BATCH 32
+#define BPFLIMIT_GC_SLICE (HZ / 100 ? : 1)
+
+/* bring gc_work forward to @due.  Called with bpflimit_mutex held. */
+static void bpflimit_gc_kick(struct bpflimit_net *bpflimit_net,
+			     unsigned long due)
 {
-	return time_after_eq(jiffies, he->expires);
+	long delay = (long)(due - jiffies);
+
+	if (delayed_work_pending(&bpflimit_net->gc_work) &&
+	    !time_before(due, bpflimit_net->gc_next))
+		return;
+
+	bpflimit_net->gc_next = due;
+	mod_delayed_work(system_unbound_wq, &bpflimit_net->gc_work,
+			 max(delay, 0L));
 }
 
-static void htable_selective_cleanup(struct xt_bpflimit_htable *ht,
-			bool (*select)(const struct xt_bpflimit_htable *ht,
-				      const struct dsthash_ent *he))
+/* Take a reference on up to @max tables that are due, and find when
+ * the first of the others is.  The batch goes to the back of the list,
+ * so tables that are always due cannot keep the ones behind them from
+ * their turn.  Called with bpflimit_mutex held.
+ */
+static unsigned int bpflimit_gc_pick(struct bpflimit_net *bpflimit_net,
+				     struct xt_bpflimit_htable **batch,
+				     unsigned int max, unsigned long *next,
+				     bool *pending)
 {
-	unsigned int i;
-
-	for (i = 0; i < ht->cfg.size; i++) {
-		struct dsthash_ent *dh;
-		struct hlist_node *n;
+	struct hlist_head *head = &bpflimit_net->htables;
+	struct xt_bpflimit_htable *hinfo;
+	struct hlist_node *last = NULL;
+	unsigned int i, n = 0;
 
-		spin_lock_bh(&ht->lock);
-		hlist_for_each_entry_safe(dh, n, &ht->hash[i], node) {
-			if ((*select)(ht, dh))
-				dsthash_free(ht, dh);
+	hlist_for_each_entry(hinfo, head, node) {
+		if (hinfo->cells)
+			continue;
+		if (n < max && time_after_eq(jiffies, hinfo->gc_due)) {
+			hinfo->use++;
+			batch[n++] = hinfo;
+			continue;
 		}
-		spin_unlock_bh(&ht->lock);
-		cond_resched();
+		if (!*pending || time_before(hinfo->gc_due, *next))
+			*next = hinfo->gc_due;
+		*pending = true;
 	}
+	if (n == 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		hlist_del(&batch[i]->node);
+	hlist_for_each(last, head)
+		if (last->next == NULL)
+			break;
+	for (i = 0; i < n; i++) {
+		if (last)
+			hlist_add_behind(&batch[i]->node, last);
+		else
+			hlist_add_head(&batch[i]->node, head);
+		last = &batch[i]->node;
+	}
+	return n;
 }
 
-static void htable_gc(struct work_struct *work)
+static void bpflimit_gc_work(struct work_struct *work)
 {
-	struct xt_bpflimit_htable *ht;
-
-	ht = container_of(work, struct xt_bpflimit_htable, gc_work.work);
+	struct bpflimit_net *bpflimit_net =
+		container_of(work, struct bpflimit_net, gc_work.work);
+	struct xt_bpflimit_htable *batch[BPFLIMIT_GC_BATCH];
+	unsigned long start = jiffies, next = 0;
+	bool pending = false;
+	unsigned int i, n;
+
+	for (;;) {
+		bool over = time_after(jiffies, start + BPFLIMIT_GC_SLICE);
+
+		mutex_lock(&bpflimit_mutex);
+		n = bpflimit_gc_pick(bpflimit_net, batch,
+				     over ? 0 : BPFLIMIT_GC_BATCH,
+				     &next, &pending);
+		if (n == 0) {
+			if (pending) {
+				/* yield, even if more is due already */
+				if (!time_after(next, jiffies))
+					next = jiffies + 1;
+				bpflimit_gc_kick(bpflimit_net, next);
+			}
+			mutex_unlock(&bpflimit_mutex);
+			return;
+		}
+		mutex_unlock(&bpflimit_mutex);
 
-	htable_selective_cleanup(ht, select_gc);
+		for (i = 0; i < n; i++) {
+			struct xt_bpflimit_htable *hinfo = batch[i];
 
-	queue_delayed_work(system_power_efficient_wq,
-			   &ht->gc_work, msecs_to_jiffies(ht->cfg.gc_interval));
+			hinfo->gc_due = htable_gc(hinfo) ? jiffies :
+				jiffies + msecs_to_jiffies(hinfo->cfg.gc_interval);
+			htable_put(hinfo);
+		}
+		pending = false;
+	}
 }
 
 static void htable_remove_proc_entry(struct xt_bpflimit_htable *hinfo)
@@ -520,11 +2203,32 @@ static void htable_remove_proc_entry(struct xt_bpflimit_htable *hinfo)
 
 static void htable_destroy(struct xt_bpflimit_htable *hinfo)
 {
-	cancel_delayed_work_sync(&hinfo->gc_work);
 	htable_remove_proc_entry(hinfo);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_SHRINK)
+		htable_shrinker_free(hinfo);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_PARENT)
+		htable_selective_cleanup(hinfo, select_child);
 	htable_selective_cleanup(hinfo, select_all);
+	/* entries on their way back to the magazines */
+	if (hinfo->cfg.mode & XT_BPFLIMIT_PREALLOC)
+		rcu_barrier();
+	if (!hinfo->cells) {
+		cancel_work_sync(&hinfo->mag_work);
+		htable_mag_drain(hinfo);
+	}
+	free_percpu(hinfo->global.local);
+	if (hinfo->prog)
+		bpf_prog_put(hinfo->prog);
+	free_bucket_spinlocks(hinfo->locks);
+	percpu_counter_destroy(&hinfo->count);
+	kvfree(rcu_dereference_protected(hinfo->table, 1));
+	vfree(hinfo->cells);
+	vfree(hinfo->cms);
+	kfree(rcu_dereference_protected(hinfo->rates, 1));
+	kfree(hinfo->wheel.map);
 	kfree(hinfo->name);
-	vfree(hinfo);
+	htable_memcg_put(hinfo);
+	kfree(hinfo);
 }
 
 static struct xt_bpflimit_htable *htable_find_get(struct net *net,
@@ -647,17 +2351,170 @@ static u64 user2rate_bytes(u32 user)
 	return (r - 1) << XT_BPFLIMIT_BYTE_SHIFT;
 }
 
-static void rateinfo_recalc(struct dsthash_ent *dh, unsigned long now,
-			    u32 mode, int revision)
+/* Revision 4 byte mode takes bytes per second and a burst in bytes.
+ * Credits are byte-nanoseconds: an entry gains avg credits per ns and a
+ * packet costs len * NSEC_PER_SEC, so nothing is rounded.  A refill is
+ * clamped to the time it takes to fill the whole burst, which keeps the
+ * product in range however long the entry sat idle.
+ */
+static inline u64 bpflimit_byte_cost_ns(u64 len)
+{
+	return (u64)len * NSEC_PER_SEC;
+}
+
+/* GCRA (the virtual scheduling form of the token bucket above) keeps a
+ * single theoretical arrival time per entry, in ns.  The u64 is only
+ * ever compared through signed differences.  Admitting while
+ * tat - now <= tau, with tau = (burst - 1) * t, passes exactly the
+ * packets that a bucket of burst * cost credits refilled at one cost
+ * per t would pass.
+ */
+
+static bool gcra_admit(struct dsthash_ent *dh, u64 now, u64 t, u64 tau)
+{
+	s64 old = atomic64_read(&dh->rateinfo.tat);
+	s64 cur;
+
+	for (;;) {
+		u64 tat = (s64)((u64)old - now) > 0 ? (u64)old : now;
+
+		if (tat - now > tau)
+			return false;
+
+		cur = atomic64_cmpxchg(&dh->rateinfo.tat, old, tat + t);
+		if (cur == old)
+			return true;
+		old = cur;
+	}
+}
+
+/* Admitting @segs packets at once moves tat by segs emission intervals
+ * and needs all of them to fit in the burst.  @r is a pinned rate, or
+ * NULL for the table's.
+ */
+static bool gcra_segs(const struct xt_bpflimit_htable *ht,
+		      const struct bpflimit_rate *r, u32 segs,
+		      u64 *t, u64 *tau)
+{
+	u64 burst = r ? r->burst : ht->cfg.burst;
+	u64 gcra_t = r ? r->gcra_t : ht->rateinfo.gcra_t;
+	u64 gcra_tau = r ? r->gcra_tau : ht->rateinfo.gcra_tau;
+
+	if (segs > burst)
+		return false;
+
+	*t = segs * gcra_t;
+	*tau = gcra_tau + gcra_t - *t;
+	return true;
+}
+
+/* XT_BPFLIMIT_SKETCH: the table is a count-min sketch of GCRA arrival
+ * times instead of per-key entries.  Collisions only ever push a cell
+ * later, so the earliest of the key's cells is the best estimate of
+ * its own arrival time.  Admitted packets raise just the cells that
+ * are behind the new time (conservative update).  Concurrent packets
+ * of one key may all be admitted against the same estimate; the limit
+ * is approximate anyway.
+ */
+static bool sketch_admit(struct xt_bpflimit_htable *ht, u_int32_t hash,
+			 u64 now, u64 t, u64 tau)
+{
+	atomic64_t *cell[BPFLIMIT_CMS_DEPTH];
+	u64 tat = now;
+	unsigned int i;
+
+	for (i = 0; i < BPFLIMIT_CMS_DEPTH; i++) {
+		u64 v;
+
+		cell[i] = ht->cells + (i << ht->cms_bits) +
+			  hash_32(hash ^ ht->cms_seed[i], ht->cms_bits);
+		v = atomic64_read(cell[i]);
+		if ((s64)(v - now) < 0)
+			v = now;
+		if (i == 0 || (s64)(v - tat) < 0)
+			tat = v;
+	}
+
+	if (tat - now > tau)
+		return false;
+
+	tat += t;
+	for (i = 0; i < BPFLIMIT_CMS_DEPTH; i++) {
+		s64 old = atomic64_read(cell[i]);
+		s64 cur;
+
+		while ((s64)((u64)old - tat) < 0) {
+			cur = atomic64_cmpxchg(cell[i], old, tat);
+			if (cur == old)
+				break;
+			old = cur;
+		}
+	}
+	return true;
+}
+
+/* aggregates are always token buckets on the ns clock */
+static void parent_refill(struct dsthash_ent *p,
+			  const struct xt_bpflimit_htable *hinfo, u64 now)
+{
+	u64 delta = now - p->rateinfo.prev;
+
+	if ((s64)delta <= 0)
+		return;
+
+	p->rateinfo.prev = now;
+	delta = min(delta, hinfo->parent.fill);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES)
+		delta *= hinfo->parent.cost;
+	p->rateinfo.credit = min(p->rateinfo.credit + delta,
+				 hinfo->parent.credit_cap);
+}
+
+static void rateinfo_recalc(struct dsthash_ent *dh,
+			    const struct xt_bpflimit_htable *hinfo,
+			    u64 now, int revision)
 {
-	unsigned long delta = now - dh->rateinfo.prev;
+	const struct bpflimit_rate *r = dsthash_rate(hinfo, dh);
+	u64 delta = now - dh->rateinfo.prev;
+	u32 mode = hinfo->cfg.mode;
 	u64 cap, cpj;
 
-	if (delta == 0)
+	if (dsthash_is_parent(hinfo, &dh->dst)) {
+		parent_refill(dh, hinfo, now);
 		return;
+	}
+
+	/* GCRA state is derived from the clock, nothing to refill */
+	if (mode & XT_BPFLIMIT_GCRA)
+		return;
+
+	/* the clock is read before the entry is locked, so another cpu
+	 * may already have moved prev past our now */
+	if ((s64)delta <= 0)
+		return;
+
+	if (mode & XT_BPFLIMIT_RATE_MATCH && hinfo->ns) {
+		u64 interval = hinfo->rateinfo.interval;
+
+		if (delta < interval)
+			return;
+
+		/* the window slides on, the one just closed is weighed in
+		 * by bpflimit_window_est() */
+		if (delta < 2 * interval) {
+			dh->rateinfo.prev += interval;
+			dh->rateinfo.prev_window =
+				min_t(u64, dh->rateinfo.current_rate, U32_MAX);
+		} else {
+			dh->rateinfo.prev = now;
+			dh->rateinfo.prev_window = 0;
+		}
+		dh->rateinfo.current_rate = 0;
+		return;
+	}
 
 	if (revision >= 3 && mode & XT_BPFLIMIT_RATE_MATCH) {
-		u64 interval = dh->rateinfo.interval * HZ;
+		u64 interval = hinfo->rateinfo.interval * HZ;
 
 		if (delta < interval)
 			return;
@@ -665,7 +2522,7 @@ static void rateinfo_recalc(struct dsthash_ent *dh, unsigned long now,
 		dh->rateinfo.prev = now;
 		dh->rateinfo.prev_window =
 			((dh->rateinfo.current_rate * interval) >
-			 (delta * dh->rateinfo.rate));
+			 (delta * hinfo->rateinfo.rate));
 		dh->rateinfo.current_rate = 0;
 
 		return;
@@ -673,7 +2530,14 @@ static void rateinfo_recalc(struct dsthash_ent *dh, unsigned long now,
 
 	dh->rateinfo.prev = now;
 
-	if (mode & XT_BPFLIMIT_BYTES) {
+	if (mode & XT_BPFLIMIT_BYTES && r) {
+		dh->rateinfo.credit += min(delta, r->fill) * r->cost;
+		cap = r->credit_cap;
+	} else if (mode & XT_BPFLIMIT_BYTES && hinfo->ns) {
+		dh->rateinfo.credit += min(delta, hinfo->rateinfo.fill) *
+				       hinfo->rateinfo.cost;
+		cap = hinfo->rateinfo.credit_cap;
+	} else if (mode & XT_BPFLIMIT_BYTES) {
 		u64 tmp = dh->rateinfo.credit;
 		dh->rateinfo.credit += CREDITS_PER_JIFFY_BYTES * delta;
 		cap = CREDITS_PER_JIFFY_BYTES * HZ;
@@ -682,45 +2546,143 @@ static void rateinfo_recalc(struct dsthash_ent *dh, unsigned long now,
 			return;
 		}
 	} else {
-		cpj = (revision == 1) ?
-			CREDITS_PER_JIFFY_v1 : CREDITS_PER_JIFFY;
+		if (hinfo->ns)
+			cpj = 1;
+		else
+			cpj = (revision == 1) ?
+				CREDITS_PER_JIFFY_v1 : CREDITS_PER_JIFFY;
 		dh->rateinfo.credit += delta * cpj;
-		cap = dh->rateinfo.credit_cap;
+		cap = r ? r->credit_cap : hinfo->rateinfo.credit_cap;
 	}
 	if (dh->rateinfo.credit > cap)
 		dh->rateinfo.credit = cap;
 }
 
-static void rateinfo_init(struct dsthash_ent *dh,
-			  struct xt_bpflimit_htable *hinfo, int revision)
+static void htable_rateinfo_init(struct xt_bpflimit_htable *hinfo,
+				 int revision)
 {
-	dh->rateinfo.prev = jiffies;
-	if (revision >= 3 && hinfo->cfg.mode & XT_BPFLIMIT_RATE_MATCH) {
-		dh->rateinfo.prev_window = 0;
-		dh->rateinfo.current_rate = 0;
+	if (hinfo->cfg.mode & (XT_BPFLIMIT_GCRA | XT_BPFLIMIT_SKETCH)) {
+		hinfo->rateinfo.gcra_t = user2ns(hinfo->cfg.avg);
+		hinfo->rateinfo.gcra_tau =
+			hinfo->rateinfo.gcra_t * (hinfo->cfg.burst - 1);
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_RATE_MATCH && hinfo->ns) {
+		u64 window = (u64)hinfo->cfg.interval * NSEC_PER_MSEC;
+
+		/* what one window may carry at the rate, burst on top */
+		if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES)
+			hinfo->rateinfo.rate = div_u64(hinfo->cfg.avg *
+						       hinfo->cfg.interval,
+						       MSEC_PER_SEC);
+		else
+			hinfo->rateinfo.rate = div64_u64(window,
+							 user2ns(hinfo->cfg.avg));
+		hinfo->rateinfo.burst = hinfo->rateinfo.rate + hinfo->cfg.burst;
+		hinfo->rateinfo.interval = window;
+		hinfo->rateinfo.shift = fls64(window) > 32 ?
+					fls64(window) - 32 : 0;
+	} else if (revision >= 3 && hinfo->cfg.mode & XT_BPFLIMIT_RATE_MATCH) {
 		if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES) {
-			dh->rateinfo.rate =
+			hinfo->rateinfo.rate =
 				user2rate_bytes((u32)hinfo->cfg.avg);
 			if (hinfo->cfg.burst)
-				dh->rateinfo.burst =
-					hinfo->cfg.burst * dh->rateinfo.rate;
+				hinfo->rateinfo.burst =
+					hinfo->cfg.burst * hinfo->rateinfo.rate;
 			else
-				dh->rateinfo.burst = dh->rateinfo.rate;
+				hinfo->rateinfo.burst = hinfo->rateinfo.rate;
 		} else {
-			dh->rateinfo.rate = user2rate(hinfo->cfg.avg);
-			dh->rateinfo.burst =
-				hinfo->cfg.burst + dh->rateinfo.rate;
+			hinfo->rateinfo.rate = user2rate(hinfo->cfg.avg);
+			hinfo->rateinfo.burst =
+				hinfo->cfg.burst + hinfo->rateinfo.rate;
 		}
-		dh->rateinfo.interval = hinfo->cfg.interval;
+		hinfo->rateinfo.interval = hinfo->cfg.interval;
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES && hinfo->ns) {
+		hinfo->rateinfo.cost = hinfo->cfg.avg;
+		hinfo->rateinfo.credit_cap = hinfo->cfg.burst * NSEC_PER_SEC;
+		hinfo->rateinfo.fill =
+			div64_u64(hinfo->rateinfo.credit_cap + hinfo->cfg.avg - 1,
+				  hinfo->cfg.avg);
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES) {
+		hinfo->rateinfo.cost = user2credits_byte(hinfo->cfg.avg);
+		hinfo->rateinfo.credit_cap = hinfo->cfg.burst;
+	} else if (hinfo->ns) {
+		hinfo->rateinfo.cost = user2ns(hinfo->cfg.avg);
+		hinfo->rateinfo.credit_cap =
+			hinfo->rateinfo.cost * hinfo->cfg.burst;
+	} else {
+		hinfo->rateinfo.cost = user2credits(hinfo->cfg.avg, revision);
+		hinfo->rateinfo.credit_cap =
+			user2credits(hinfo->cfg.avg * hinfo->cfg.burst,
+				     revision);
+	}
+
+	if (hinfo->cfg.mode & XT_BPFLIMIT_PARENT &&
+	    hinfo->cfg.mode & XT_BPFLIMIT_BYTES) {
+		hinfo->parent.cost = hinfo->cfg.parent_avg;
+		hinfo->parent.credit_cap =
+			hinfo->cfg.parent_burst * NSEC_PER_SEC;
+		hinfo->parent.fill =
+			div64_u64(hinfo->parent.credit_cap +
+				  hinfo->cfg.parent_avg - 1,
+				  hinfo->cfg.parent_avg);
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_PARENT) {
+		hinfo->parent.cost = user2ns(hinfo->cfg.parent_avg);
+		hinfo->parent.credit_cap =
+			hinfo->parent.cost * hinfo->cfg.parent_burst;
+		hinfo->parent.fill = hinfo->parent.credit_cap;
+	}
+
+	if (hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL &&
+	    hinfo->cfg.mode & XT_BPFLIMIT_BYTES) {
+		hinfo->global.cost = hinfo->cfg.global_avg;
+		hinfo->global.credit_cap =
+			hinfo->cfg.global_burst * NSEC_PER_SEC;
+		hinfo->global.fill =
+			div64_u64(hinfo->global.credit_cap +
+				  hinfo->cfg.global_avg - 1,
+				  hinfo->cfg.global_avg);
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL) {
+		hinfo->global.cost = user2ns(hinfo->cfg.global_avg);
+		hinfo->global.credit_cap =
+			hinfo->global.cost * hinfo->cfg.global_burst;
+		hinfo->global.fill = hinfo->global.credit_cap;
+	}
+	/* a few batches per cpu fit in the burst, so little of it
+	 * sits idle on cpus that stopped seeing packets */
+	hinfo->global.batch = div_u64(hinfo->global.credit_cap,
+				      4 * num_possible_cpus());
+}
+
+static void rateinfo_init(struct dsthash_ent *dh,
+			  struct xt_bpflimit_htable *hinfo,
+			  u64 now, u32 spent, int revision)
+{
+	dh->rateinfo.prev = now;
+	if (dsthash_is_parent(hinfo, &dh->dst)) {
+		dh->rateinfo.credit = hinfo->parent.credit_cap;
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_GCRA) {
+		u64 debt = spent < hinfo->cfg.burst ?
+			   spent * hinfo->rateinfo.gcra_t :
+			   hinfo->rateinfo.gcra_tau;
+
+		atomic64_set(&dh->rateinfo.tat, now + debt);
+	} else if (revision >= 3 && hinfo->cfg.mode & XT_BPFLIMIT_RATE_MATCH) {
+		dh->rateinfo.prev_window = 0;
+		dh->rateinfo.current_rate = 0;
+	} else if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES && hinfo->ns) {
+		dh->rateinfo.credit = hinfo->rateinfo.credit_cap;
 	} else if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES) {
+		/* the per-entry refill counter starts at the burst */
 		dh->rateinfo.credit = CREDITS_PER_JIFFY_BYTES * HZ;
-		dh->rateinfo.cost = user2credits_byte(hinfo->cfg.avg);
-		dh->rateinfo.credit_cap = hinfo->cfg.burst;
+		dh->rateinfo.credit_cap = min_t(u64, hinfo->rateinfo.credit_cap,
+						U32_MAX);
 	} else {
-		dh->rateinfo.credit = user2credits(hinfo->cfg.avg *
-						   hinfo->cfg.burst, revision);
-		dh->rateinfo.cost = user2credits(hinfo->cfg.avg, revision);
-		dh->rateinfo.credit_cap = dh->rateinfo.credit;
+		/* packets the sketch let through come off the burst */
+		u64 debt = spent < hinfo->cfg.burst ?
+			   spent * hinfo->rateinfo.cost :
+			   hinfo->rateinfo.credit_cap;
+
+		dh->rateinfo.credit = hinfo->rateinfo.credit_cap -
+			min(debt, hinfo->rateinfo.credit_cap);
 	}
 }
 
@@ -763,7 +2725,13 @@ bpflimit_init_dst(const struct xt_bpflimit_htable *hinfo,
 	u8 nexthdr;
 	int poff;
 
-	memset(dst, 0, sizeof(*dst));
+	memset((void *)dsthash_key(hinfo, dst), 0,
+	       hinfo->keywords * sizeof(u32));
+
+	/* the program sees the packet from the network header, like xt_bpf */
+	if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		dst->bpf = bpf_prog_run_save_cb(hinfo->prog,
+						(struct sk_buff *)skb);
 
 	switch (hinfo->family) {
 	case NFPROTO_IPV4:
@@ -827,10 +2795,168 @@ bpflimit_init_dst(const struct xt_bpflimit_htable *hinfo,
 	return 0;
 }
 
-static u32 bpflimit_byte_cost(unsigned int len, struct dsthash_ent *dh)
+/* XT_BPFLIMIT_PARENT: the aggregate key covers the child's addresses
+ * under the parent masks.  Ports never take part in it.  Only the
+ * addresses are taken over, the child's key is not filled in beyond
+ * its key span.
+ */
+static void bpflimit_parent_dst(const struct xt_bpflimit_htable *hinfo,
+				struct dsthash_dst *p,
+				const struct dsthash_dst *dst)
+{
+	memset(p, 0, hinfo->keylen);
+	p->bpf = DSTHASH_PARENT;
+
+	switch (hinfo->family) {
+	case NFPROTO_IPV4:
+		if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_DIP)
+			p->ip.dst = maskl(dst->ip.dst,
+					  hinfo->cfg.parent_dstmask);
+		if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_SIP)
+			p->ip.src = maskl(dst->ip.src,
+					  hinfo->cfg.parent_srcmask);
+		break;
+#if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
+	case NFPROTO_IPV6:
+		if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_DIP) {
+			memcpy(p->ip6.dst, dst->ip6.dst, sizeof(p->ip6.dst));
+			bpflimit_ipv6_mask(p->ip6.dst,
+					   hinfo->cfg.parent_dstmask);
+		}
+		if (hinfo->cfg.mode & XT_BPFLIMIT_HASH_SIP) {
+			memcpy(p->ip6.src, dst->ip6.src, sizeof(p->ip6.src));
+			bpflimit_ipv6_mask(p->ip6.src,
+					   hinfo->cfg.parent_srcmask);
+		}
+		break;
+#endif
+	}
+}
+
+/* find or create the aggregate of @dst, with a reference for a child */
+static struct dsthash_ent *
+dsthash_parent_get(struct xt_bpflimit_htable *hinfo,
+		   const struct dsthash_dst *dst, u64 now)
+{
+	struct dsthash_dst p;
+
+	bpflimit_parent_dst(hinfo, &p, dst);
+	return dsthash_alloc_init(hinfo, &p, hash_key(hinfo, &p), now, 0,
+				  NULL, 4);
+}
+
+/* Charge the aggregate as well.  Children are always locked before
+ * their aggregate, and only children are ever looked up by packets.
+ */
+static bool parent_charge(struct dsthash_ent *p,
+			  const struct xt_bpflimit_htable *hinfo,
+			  u64 now, u32 segs, u64 bytes)
+{
+	u64 cost;
+	bool ok;
+
+	if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES)
+		cost = bpflimit_byte_cost_ns(bytes);
+	else
+		cost = hinfo->parent.cost *
+		       min_t(u64, segs, hinfo->cfg.parent_burst + 1);
+
+	spin_lock_nested(&p->rateinfo.lock, SINGLE_DEPTH_NESTING);
+	parent_refill(p, hinfo, now);
+	ok = p->rateinfo.credit >= cost;
+	if (ok)
+		p->rateinfo.credit -= cost;
+	spin_unlock(&p->rateinfo.lock);
+	return ok;
+}
+
+/* XT_BPFLIMIT_GLOBAL: one token bucket over every key of the table.
+ * A cpu takes credit from the shared pool a batch at a time and spends
+ * it locally, so the pool is only written once per batch and never
+ * under a lock.  What the other cpus still hold, a batch each at most,
+ * may pass on top of the ceiling.  Called with BH disabled.
+ */
+static void global_refill(struct xt_bpflimit_htable *hinfo, u64 now)
+{
+	u64 prev = atomic64_read(&hinfo->global.prev);
+	u64 delta = now - prev;
+	s64 old, cur, new;
+
+	/* whoever moves prev adds the time since, the others got nothing */
+	if ((s64)delta <= 0 ||
+	    atomic64_cmpxchg(&hinfo->global.prev, prev, now) != prev)
+		return;
+
+	delta = min(delta, hinfo->global.fill);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES)
+		delta *= hinfo->global.cost;
+
+	old = atomic64_read(&hinfo->global.credit);
+	for (;;) {
+		new = min_t(u64, old + delta, hinfo->global.credit_cap);
+		cur = atomic64_cmpxchg(&hinfo->global.credit, old, new);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+static u64 global_cost(const struct xt_bpflimit_htable *hinfo,
+		       u32 segs, u64 bytes)
+{
+	if (hinfo->cfg.mode & XT_BPFLIMIT_BYTES)
+		return bpflimit_byte_cost_ns(bytes);
+	return hinfo->global.cost *
+	       min_t(u64, segs, hinfo->cfg.global_burst + 1);
+}
+
+static bool global_charge(struct xt_bpflimit_htable *hinfo, u64 now,
+			  u64 cost)
+{
+	u64 *local = this_cpu_ptr(hinfo->global.local);
+	u64 need, take;
+	s64 old, cur;
+
+	if (likely(*local >= cost)) {
+		*local -= cost;
+		return true;
+	}
+
+	global_refill(hinfo, now);
+	need = cost - *local;
+	old = atomic64_read(&hinfo->global.credit);
+	for (;;) {
+		if (old < (s64)need)
+			return false;
+		take = min_t(u64, old, need + hinfo->global.batch);
+		cur = atomic64_cmpxchg(&hinfo->global.credit, old, old - take);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+	*local += take - cost;
+	return true;
+}
+
+/* the packet was refused further down, keep its credit on this cpu */
+static void global_refund(struct xt_bpflimit_htable *hinfo, u64 cost)
+{
+	if (hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL)
+		*this_cpu_ptr(hinfo->global.local) += cost;
+}
+
+static bool bpflimit_global(struct xt_bpflimit_htable *hinfo, u64 now,
+			    u64 cost)
+{
+	return !(hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL) ||
+	       global_charge(hinfo, now, cost);
+}
+
+static u32 bpflimit_byte_cost(unsigned int len, struct dsthash_ent *dh,
+			      const struct xt_bpflimit_htable *hinfo)
 {
 	u64 tmp = xt_bpflimit_len_to_chunks(len);
-	tmp = tmp * dh->rateinfo.cost;
+	tmp = tmp * hinfo->rateinfo.cost;
 
 	if (unlikely(tmp > CREDITS_PER_JIFFY_BYTES * HZ))
 		tmp = CREDITS_PER_JIFFY_BYTES * HZ;
@@ -842,48 +2968,177 @@ static u32 bpflimit_byte_cost(unsigned int len, struct dsthash_ent *dh)
 	return (u32) tmp;
 }
 
+/* Sliding window counter: the window that closed last counts for the
+ * part of it that still overlaps a window ending now.  The interval is
+ * shifted down to 32 bits so the weighing cannot overflow.
+ */
+static u64 bpflimit_window_est(const struct dsthash_ent *dh,
+			       const struct xt_bpflimit_htable *hinfo,
+			       u64 now)
+{
+	u64 interval = hinfo->rateinfo.interval;
+	u64 elapsed = now - dh->rateinfo.prev;
+	unsigned int shift = hinfo->rateinfo.shift;
+
+	if ((s64)elapsed < 0)
+		elapsed = 0;
+	if (elapsed >= interval || !dh->rateinfo.prev_window)
+		return dh->rateinfo.current_rate;
+
+	return dh->rateinfo.current_rate +
+	       div_u64((u64)dh->rateinfo.prev_window *
+		       ((interval - elapsed) >> shift),
+		       interval >> shift);
+}
+
+/* A GRO or GSO packet stands for gso_segs packets on the wire, each
+ * carrying its own copy of the network and transport headers.
+ */
+static void bpflimit_wire(const struct sk_buff *skb, unsigned int thoff,
+			  u32 *segs, u64 *bytes)
+{
+	const struct skb_shared_info *shinfo = skb_shinfo(skb);
+	unsigned int hdr = thoff;
+
+	if (!skb_is_gso(skb))
+		return;
+
+	if (shinfo->gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6)) {
+		const struct tcphdr *th;
+		struct tcphdr _th;
+
+		th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+		hdr += th ? th->doff * 4 : sizeof(_th);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	} else if (shinfo->gso_type & SKB_GSO_UDP_L4) {
+		hdr += sizeof(struct udphdr);
+#endif
+	}
+
+	/* untrusted sources leave gso_segs for the stack to fill in */
+	if (shinfo->gso_segs)
+		*segs = shinfo->gso_segs;
+	else if (skb->len > hdr)
+		*segs = DIV_ROUND_UP(skb->len - hdr, shinfo->gso_size);
+	*bytes = skb->len + (u64)(*segs - 1) * hdr;
+}
+
 static bool
 bpflimit_mt_common(const struct sk_buff *skb, struct xt_action_param *par,
 		    struct xt_bpflimit_htable *hinfo,
-		    const struct bpflimit_cfg3 *cfg, int revision)
+		    const struct bpflimit_cfg4 *cfg, int revision)
 {
-	unsigned long now = jiffies;
-	struct dsthash_ent *dh;
+	struct dsthash_ent *dh, *parent = NULL;
+	const struct bpflimit_rate *r;
 	struct dsthash_dst dst;
-	bool race = false;
-	u64 cost;
+	u32 expires;
+	u_int32_t hash;
+	u64 now, cost, t, tau, gcost = 0;
+	u64 bytes = skb->len;
+	u32 segs = 1;
+	bool fresh = false;
 
 	if (bpflimit_init_dst(hinfo, &dst, skb, par->thoff) < 0)
 		goto hotdrop;
 
+	/* revision 4 charges what goes on the wire */
+	if (revision >= 4)
+		bpflimit_wire(skb, par->thoff, &segs, &bytes);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_GLOBAL)
+		gcost = global_cost(hinfo, segs, bytes);
+
+	hash = hash_key(hinfo, &dst);
+	now = bpflimit_clock(hinfo);
+
+	if (hinfo->cells) {
+		bool admit = false;
+
+		/* the sketch cannot take a packet back, ask the ceiling first */
+		local_bh_disable();
+		if (gcra_segs(hinfo, NULL, segs, &t, &tau) &&
+		    bpflimit_global(hinfo, now, gcost)) {
+			admit = sketch_admit(hinfo, hash, now, t, tau);
+			if (!admit)
+				global_refund(hinfo, gcost);
+		}
+		local_bh_enable();
+		if (admit)
+			return !(cfg->mode & XT_BPFLIMIT_INVERT);
+		/* default match is underlimit - so over the limit, we need to invert */
+		return cfg->mode & XT_BPFLIMIT_INVERT;
+	}
+
 	local_bh_disable();
-	dh = dsthash_find(hinfo, &dst);
+	dh = dsthash_lookup_rcu(hinfo, &dst, hash);
 	if (dh == NULL) {
-		dh = dsthash_alloc_init(hinfo, &dst, &race);
+		u32 seen = 1;
+
+		/* not admit packets beyond the rate yet, the burst covers it */
+		if (hinfo->cms) {
+			seen = cms_add(hinfo, hash);
+			if (seen < hinfo->cfg.admit) {
+				bool admit = bpflimit_global(hinfo, now, gcost);
+
+				local_bh_enable();
+				if (admit)
+					return !(cfg->mode & XT_BPFLIMIT_INVERT);
+				return cfg->mode & XT_BPFLIMIT_INVERT;
+			}
+		}
+		if (hinfo->cfg.mode & XT_BPFLIMIT_PARENT) {
+			parent = dsthash_parent_get(hinfo, &dst, now);
+			if (parent == NULL) {
+				local_bh_enable();
+				goto hotdrop;
+			}
+		}
+		dh = dsthash_alloc_init(hinfo, &dst, hash, now, seen - 1,
+					parent, revision);
 		if (dh == NULL) {
 			local_bh_enable();
 			goto hotdrop;
-		} else if (race) {
-			/* Already got an entry, update expiration timeout */
-			dh->expires = now + msecs_to_jiffies(hinfo->cfg.expire);
-			rateinfo_recalc(dh, now, hinfo->cfg.mode, revision);
-		} else {
-			dh->expires = jiffies + msecs_to_jiffies(hinfo->cfg.expire);
-			rateinfo_init(dh, hinfo, revision);
 		}
-	} else {
-		/* update expiration timeout */
-		dh->expires = now + msecs_to_jiffies(hinfo->cfg.expire);
-		rateinfo_recalc(dh, now, hinfo->cfg.mode, revision);
+		fresh = true;
+	}
+
+	/* update expiration timeout, an aggregate outlives its children;
+	 * a new entry keeps its probation until the key comes back */
+	expires = bpflimit_stamp + msecs_to_jiffies(hinfo->cfg.expire);
+	if (!fresh)
+		WRITE_ONCE(dh->expires, expires);
+	if (hinfo->cfg.mode & XT_BPFLIMIT_PARENT)
+		WRITE_ONCE(dh->parent->expires, expires);
+
+	if (hinfo->cfg.mode & XT_BPFLIMIT_GCRA) {
+		bool admit = false;
+
+		if (gcra_segs(hinfo, dsthash_rate(hinfo, dh), segs, &t, &tau) &&
+		    bpflimit_global(hinfo, now, gcost)) {
+			admit = gcra_admit(dh, now, t, tau);
+			if (!admit)
+				global_refund(hinfo, gcost);
+		}
+		local_bh_enable();
+		if (admit)
+			return !(cfg->mode & XT_BPFLIMIT_INVERT);
+		/* default match is underlimit - so over the limit, we need to invert */
+		return cfg->mode & XT_BPFLIMIT_INVERT;
 	}
 
+	spin_lock(&dh->rateinfo.lock);
+	rateinfo_recalc(dh, hinfo, now, revision);
+
 	if (cfg->mode & XT_BPFLIMIT_RATE_MATCH) {
-		cost = (cfg->mode & XT_BPFLIMIT_BYTES) ? skb->len : 1;
+		cost = (cfg->mode & XT_BPFLIMIT_BYTES) ? bytes : segs;
 		dh->rateinfo.current_rate += cost;
 
-		if (!dh->rateinfo.prev_window &&
-		    (dh->rateinfo.current_rate <= dh->rateinfo.burst)) {
-			spin_unlock(&dh->lock);
+		if ((hinfo->ns ?
+		     bpflimit_window_est(dh, hinfo, now) <=
+		     hinfo->rateinfo.burst :
+		     !dh->rateinfo.prev_window &&
+		     (dh->rateinfo.current_rate <= hinfo->rateinfo.burst)) &&
+		    bpflimit_global(hinfo, now, gcost)) {
+			spin_unlock(&dh->rateinfo.lock);
 			local_bh_enable();
 			return !(cfg->mode & XT_BPFLIMIT_INVERT);
 		} else {
@@ -891,21 +3146,31 @@ bpflimit_mt_common(const struct sk_buff *skb, struct xt_action_param *par,
 		}
 	}
 
-	if (cfg->mode & XT_BPFLIMIT_BYTES)
-		cost = bpflimit_byte_cost(skb->len, dh);
-	else
-		cost = dh->rateinfo.cost;
-
-	if (dh->rateinfo.credit >= cost) {
-		/* below the limit */
-		dh->rateinfo.credit -= cost;
-		spin_unlock(&dh->lock);
-		local_bh_enable();
-		return !(cfg->mode & XT_BPFLIMIT_INVERT);
+	if (cfg->mode & XT_BPFLIMIT_BYTES && hinfo->ns)
+		cost = bpflimit_byte_cost_ns(bytes);
+	else if (cfg->mode & XT_BPFLIMIT_BYTES)
+		cost = bpflimit_byte_cost(skb->len, dh, hinfo);
+	else if ((r = dsthash_rate(hinfo, dh)) != NULL)
+		cost = r->cost * min_t(u64, segs, r->burst + 1);
+	else	/* more segments than the burst never fit anyway */
+		cost = hinfo->rateinfo.cost *
+		       min_t(u64, segs, hinfo->cfg.burst + 1);
+
+	if (dh->rateinfo.credit >= cost &&
+	    bpflimit_global(hinfo, now, gcost)) {
+		if (!(hinfo->cfg.mode & XT_BPFLIMIT_PARENT) ||
+		    parent_charge(dh->parent, hinfo, now, segs, bytes)) {
+			/* below the limit */
+			dh->rateinfo.credit -= cost;
+			spin_unlock(&dh->rateinfo.lock);
+			local_bh_enable();
+			return !(cfg->mode & XT_BPFLIMIT_INVERT);
+		}
+		global_refund(hinfo, gcost);
 	}
 
 overlimit:
-	spin_unlock(&dh->lock);
+	spin_unlock(&dh->rateinfo.lock);
 	local_bh_enable();
 	/* default match is underlimit - so over the limit, we need to invert */
 	return cfg->mode & XT_BPFLIMIT_INVERT;
@@ -920,7 +3185,7 @@ bpflimit_mt_v1(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_bpflimit_mtinfo1 *info = par->matchinfo;
 	struct xt_bpflimit_htable *hinfo = info->hinfo;
-	struct bpflimit_cfg3 cfg = {};
+	struct bpflimit_cfg4 cfg = {};
 	int ret;
 
 	ret = cfg_copy(&cfg, (void *)&info->cfg, 1);
@@ -935,7 +3200,7 @@ bpflimit_mt_v2(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_bpflimit_mtinfo2 *info = par->matchinfo;
 	struct xt_bpflimit_htable *hinfo = info->hinfo;
-	struct bpflimit_cfg3 cfg = {};
+	struct bpflimit_cfg4 cfg = {};
 	int ret;
 
 	ret = cfg_copy(&cfg, (void *)&info->cfg, 2);
@@ -946,24 +3211,54 @@ bpflimit_mt_v2(const struct sk_buff *skb, struct xt_action_param *par)
 }
 
 static bool
-bpflimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
+bpflimit_mt_v3(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_bpflimit_mtinfo3 *info = par->matchinfo;
 	struct xt_bpflimit_htable *hinfo = info->hinfo;
+	struct bpflimit_cfg4 cfg = {};
+	int ret;
+
+	ret = cfg_copy(&cfg, (void *)&info->cfg, 3);
+	if (ret)
+		return ret;
+
+	return bpflimit_mt_common(skb, par, hinfo, &cfg, 3);
+}
+
+static bool
+bpflimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct xt_bpflimit_mtinfo4 *info = par->matchinfo;
+	struct xt_bpflimit_htable *hinfo = info->hinfo;
+
+	return bpflimit_mt_common(skb, par, hinfo, &info->cfg, 4);
+}
 
-	return bpflimit_mt_common(skb, par, hinfo, &info->cfg, 3);
+/* revision 4 token bucket parameters: ns credits, or byte-ns ones with
+ * one refill on top of the cap, must stay far from the sign bit */
+static bool bpflimit_rate_fits(u32 mode, u64 avg, u64 burst)
+{
+	if (avg == 0 || burst == 0)
+		return false;
+	if (mode & XT_BPFLIMIT_BYTES)
+		return burst <= XT_BPFLIMIT_BYTE_BURST_MAX_v4 &&
+		       avg <= S64_MAX / 2;
+	return avg <= S64_MAX / 2 / NS_PER_USER / burst;
 }
 
 static int bpflimit_mt_check_common(const struct xt_mtchk_param *par,
 				     struct xt_bpflimit_htable **hinfo,
-				     struct bpflimit_cfg3 *cfg,
-				     const char *name, int revision)
+				     struct bpflimit_cfg4 *cfg,
+				     const char *name, const char *bpf_path,
+				     int revision)
 {
 	struct net *net = par->net;
 	int ret;
 
 	if (cfg->gc_interval == 0 || cfg->expire == 0)
 		return -EINVAL;
+	if (cfg->probation > cfg->expire)
+		return -EINVAL;
 	if (par->family == NFPROTO_IPV4) {
 		if (cfg->srcmask > 32 || cfg->dstmask > 32)
 			return -EINVAL;
@@ -978,13 +3273,97 @@ static int bpflimit_mt_check_common(const struct xt_mtchk_param *par,
 		return -EINVAL;
 	}
 
+	if (cfg->mode & XT_BPFLIMIT_HASH_BPF) {
+		if (revision < 4 || bpf_path == NULL)
+			return -EINVAL;
+		if (strnlen(bpf_path, XT_BPFLIMIT_PATH_MAX) ==
+		    XT_BPFLIMIT_PATH_MAX)
+			return -EINVAL;
+	}
+
+	if (cfg->mode & (XT_BPFLIMIT_EVICT | XT_BPFLIMIT_PREALLOC) &&
+	    revision < 4)
+		return -EINVAL;
+
+	if (cfg->admit) {
+		/* keys are judged on the sketch alone until admitted */
+		if (revision < 4 || cfg->admit > cfg->burst ||
+		    cfg->mode & (XT_BPFLIMIT_BYTES | XT_BPFLIMIT_RATE_MATCH))
+			return -EINVAL;
+	}
+
+	if (cfg->mode & (XT_BPFLIMIT_GCRA | XT_BPFLIMIT_SKETCH)) {
+		if (revision < 4 ||
+		    cfg->mode & (XT_BPFLIMIT_BYTES | XT_BPFLIMIT_RATE_MATCH))
+			return -EINVAL;
+	}
+
+	/* a sketch has no entries to admit, reserve or evict */
+	if (cfg->mode & XT_BPFLIMIT_SKETCH &&
+	    (cfg->admit ||
+	     cfg->mode & (XT_BPFLIMIT_PREALLOC | XT_BPFLIMIT_EVICT)))
+		return -EINVAL;
+
+	/* a sketch is fixed memory already */
+	if ((cfg->mode & XT_BPFLIMIT_SHRINK || cfg->maxmem) &&
+	    (revision < 4 || cfg->mode & XT_BPFLIMIT_SKETCH))
+		return -EINVAL;
+
+	if (cfg->mode & XT_BPFLIMIT_PARENT) {
+		/* aggregates are plain token buckets over coarser addresses */
+		if (revision < 4 || cfg->admit ||
+		    cfg->mode & (XT_BPFLIMIT_GCRA | XT_BPFLIMIT_SKETCH |
+				 XT_BPFLIMIT_RATE_MATCH |
+				 XT_BPFLIMIT_HASH_BPF) ||
+		    !(cfg->mode & (XT_BPFLIMIT_HASH_SIP | XT_BPFLIMIT_HASH_DIP)) ||
+		    cfg->parent_srcmask > cfg->srcmask ||
+		    cfg->parent_dstmask > cfg->dstmask)
+			return -EINVAL;
+
+		if (!bpflimit_rate_fits(cfg->mode, cfg->parent_avg,
+					cfg->parent_burst)) {
+			pr_info_ratelimited("overflow, try lower: %llu/%llu\n",
+					    cfg->parent_avg, cfg->parent_burst);
+			return -ERANGE;
+		}
+	}
+
+	if (cfg->mode & XT_BPFLIMIT_GLOBAL) {
+		if (revision < 4)
+			return -EINVAL;
+
+		if (!bpflimit_rate_fits(cfg->mode, cfg->global_avg,
+					cfg->global_burst)) {
+			pr_info_ratelimited("overflow, try lower: %llu/%llu\n",
+					    cfg->global_avg, cfg->global_burst);
+			return -ERANGE;
+		}
+	}
+
 	/* Check for overflow. */
-	if (revision >= 3 && cfg->mode & XT_BPFLIMIT_RATE_MATCH) {
-		if (cfg->avg == 0 || cfg->avg > U32_MAX) {
+	if (revision >= 4 && !(cfg->mode & XT_BPFLIMIT_RATE_MATCH)) {
+		if (!bpflimit_rate_fits(cfg->mode, cfg->avg, cfg->burst)) {
+			pr_info_ratelimited("overflow, try lower: %llu/%llu\n",
+					    cfg->avg, cfg->burst);
+			return -ERANGE;
+		}
+	} else if (revision >= 3 && cfg->mode & XT_BPFLIMIT_RATE_MATCH) {
+		if (cfg->avg == 0 || (revision < 4 && cfg->avg > U32_MAX)) {
 			pr_info_ratelimited("invalid rate\n");
 			return -ERANGE;
 		}
 
+		/* a v4 window must hold at least one packet or byte */
+		if (revision >= 4 && cfg->interval &&
+		    (cfg->mode & XT_BPFLIMIT_BYTES ?
+		     cfg->avg > U64_MAX / cfg->interval ||
+		     cfg->avg * cfg->interval < MSEC_PER_SEC :
+		     user2ns(cfg->avg) >
+		     (u64)cfg->interval * NSEC_PER_MSEC)) {
+			pr_info_ratelimited("rate does not fit the interval\n");
+			return -ERANGE;
+		}
+
 		if (cfg->interval == 0) {
 			pr_info_ratelimited("invalid interval\n");
 			return -EINVAL;
@@ -1005,8 +3384,16 @@ static int bpflimit_mt_check_common(const struct xt_mtchk_param *par,
 
 	mutex_lock(&bpflimit_mutex);
 	*hinfo = htable_find_get(net, name, par->family);
+	if (*hinfo != NULL && ((*hinfo)->revision >= 4) != (revision >= 4)) {
+		/* the table counts time differently */
+		pr_info_ratelimited("%s was created by revision %d\n",
+				    name, (*hinfo)->revision);
+		(*hinfo)->use--;
+		mutex_unlock(&bpflimit_mutex);
+		return -EINVAL;
+	}
 	if (*hinfo == NULL) {
-		ret = htable_create(net, cfg, name, par->family,
+		ret = htable_create(net, cfg, name, bpf_path, par->family,
 				    hinfo, revision);
 		if (ret < 0) {
 			mutex_unlock(&bpflimit_mutex);
@@ -1022,7 +3409,7 @@ static int bpflimit_mt_check_common(const struct xt_mtchk_param *par,
 static int bpflimit_mt_check_v1(const struct xt_mtchk_param *par)
 {
 	struct xt_bpflimit_mtinfo1 *info = par->matchinfo;
-	struct bpflimit_cfg3 cfg = {};
+	struct bpflimit_cfg4 cfg = {};
 	int ret;
 
 	ret = xt_check_proc_name(info->name, sizeof(info->name));
@@ -1034,13 +3421,13 @@ static int bpflimit_mt_check_v1(const struct xt_mtchk_param *par)
 		return ret;
 
 	return bpflimit_mt_check_common(par, &info->hinfo,
-					 &cfg, info->name, 1);
+					 &cfg, info->name, NULL, 1);
 }
 
 static int bpflimit_mt_check_v2(const struct xt_mtchk_param *par)
 {
 	struct xt_bpflimit_mtinfo2 *info = par->matchinfo;
-	struct bpflimit_cfg3 cfg = {};
+	struct bpflimit_cfg4 cfg = {};
 	int ret;
 
 	ret = xt_check_proc_name(info->name, sizeof(info->name));
@@ -1052,12 +3439,30 @@ static int bpflimit_mt_check_v2(const struct xt_mtchk_param *par)
 		return ret;
 
 	return bpflimit_mt_check_common(par, &info->hinfo,
-					 &cfg, info->name, 2);
+					 &cfg, info->name, NULL, 2);
 }
 
-static int bpflimit_mt_check(const struct xt_mtchk_param *par)
+static int bpflimit_mt_check_v3(const struct xt_mtchk_param *par)
 {
 	struct xt_bpflimit_mtinfo3 *info = par->matchinfo;
+	struct bpflimit_cfg4 cfg = {};
+	int ret;
+
+	ret = xt_check_proc_name(info->name, sizeof(info->name));
+	if (ret)
+		return ret;
+
+	ret = cfg_copy(&cfg, (void *)&info->cfg, 3);
+	if (ret)
+		return ret;
+
+	return bpflimit_mt_check_common(par, &info->hinfo,
+					 &cfg, info->name, NULL, 3);
+}
+
+static int bpflimit_mt_check(const struct xt_mtchk_param *par)
+{
+	struct xt_bpflimit_mtinfo4 *info = par->matchinfo;
 	int ret;
 
 	ret = xt_check_proc_name(info->name, sizeof(info->name));
@@ -1065,7 +3470,7 @@ static int bpflimit_mt_check(const struct xt_mtchk_param *par)
 		return ret;
 
 	return bpflimit_mt_check_common(par, &info->hinfo, &info->cfg,
-					 info->name, 3);
+					 info->name, info->bpf_path, 4);
 }
 
 static void bpflimit_mt_destroy_v2(const struct xt_mtdtor_param *par)
@@ -1082,13 +3487,20 @@ static void bpflimit_mt_destroy_v1(const struct xt_mtdtor_param *par)
 	htable_put(info->hinfo);
 }
 
-static void bpflimit_mt_destroy(const struct xt_mtdtor_param *par)
+static void bpflimit_mt_destroy_v3(const struct xt_mtdtor_param *par)
 {
 	const struct xt_bpflimit_mtinfo3 *info = par->matchinfo;
 
 	htable_put(info->hinfo);
 }
 
+static void bpflimit_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_bpflimit_mtinfo4 *info = par->matchinfo;
+
+	htable_put(info->hinfo);
+}
+
 static struct xt_match bpflimit_mt_reg[] __read_mostly = {
 	{
 		.name           = "bpflimit",
@@ -1120,10 +3532,23 @@ static struct xt_match bpflimit_mt_reg[] __read_mostly = {
 		.name           = "bpflimit",
 		.revision       = 3,
 		.family         = NFPROTO_IPV4,
-		.match          = bpflimit_mt,
+		.match          = bpflimit_mt_v3,
 		.matchsize      = sizeof(struct xt_bpflimit_mtinfo3),
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
 		.usersize	= offsetof(struct xt_bpflimit_mtinfo3, hinfo),
+#endif
+		.checkentry     = bpflimit_mt_check_v3,
+		.destroy        = bpflimit_mt_destroy_v3,
+		.me             = THIS_MODULE,
+	},
+	{
+		.name           = "bpflimit",
+		.revision       = 4,
+		.family         = NFPROTO_IPV4,
+		.match          = bpflimit_mt,
+		.matchsize      = sizeof(struct xt_bpflimit_mtinfo4),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+		.usersize	= offsetof(struct xt_bpflimit_mtinfo4, hinfo),
 #endif
 		.checkentry     = bpflimit_mt_check,
 		.destroy        = bpflimit_mt_destroy,
@@ -1160,10 +3585,23 @@ static struct xt_match bpflimit_mt_reg[] __read_mostly = {
 		.name           = "bpflimit",
 		.revision       = 3,
 		.family         = NFPROTO_IPV6,
-		.match          = bpflimit_mt,
+		.match          = bpflimit_mt_v3,
 		.matchsize      = sizeof(struct xt_bpflimit_mtinfo3),
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
 		.usersize	= offsetof(struct xt_bpflimit_mtinfo3, hinfo),
+#endif
+		.checkentry     = bpflimit_mt_check_v3,
+		.destroy        = bpflimit_mt_destroy_v3,
+		.me             = THIS_MODULE,
+	},
+	{
+		.name           = "bpflimit",
+		.revision       = 4,
+		.family         = NFPROTO_IPV6,
+		.match          = bpflimit_mt,
+		.matchsize      = sizeof(struct xt_bpflimit_mtinfo4),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+		.usersize	= offsetof(struct xt_bpflimit_mtinfo4, hinfo),
 #endif
 		.checkentry     = bpflimit_mt_check,
 		.destroy        = bpflimit_mt_destroy,
@@ -1173,14 +3611,26 @@ static struct xt_match bpflimit_mt_reg[] __read_mostly = {
 };
 
 /* PROC stuff */
+
+/* a resize may swap the table at any time, look it up on every step */
+static struct hlist_head *
+dl_seq_bucket(const struct xt_bpflimit_htable *htable, loff_t pos)
+{
+	struct dsthash_table *t = rcu_dereference_bh(htable->table);
+
+	if (t == NULL || pos >= t->size)
+		return NULL;
+	return &t->hash[pos];
+}
+
 static void *dl_seq_start(struct seq_file *s, loff_t *pos)
-	__acquires(htable->lock)
+	__acquires(RCU_BH)
 {
 	struct xt_bpflimit_htable *htable = PDE_DATA(file_inode(s->file));
 	unsigned int *bucket;
 
-	spin_lock_bh(&htable->lock);
-	if (*pos >= htable->cfg.size)
+	rcu_read_lock_bh();
+	if (dl_seq_bucket(htable, *pos) == NULL)
 		return NULL;
 
 	bucket = kmalloc(sizeof(unsigned int), GFP_ATOMIC);
@@ -1197,7 +3647,7 @@ static void *dl_seq_next(struct seq_file *s, void *v, loff_t *pos)
 	unsigned int *bucket = v;
 
 	*pos = ++(*bucket);
-	if (*pos >= htable->cfg.size) {
+	if (dl_seq_bucket(htable, *pos) == NULL) {
 		kfree(v);
 		return NULL;
 	}
@@ -1205,89 +3655,139 @@ static void *dl_seq_next(struct seq_file *s, void *v, loff_t *pos)
 }
 
 static void dl_seq_stop(struct seq_file *s, void *v)
-	__releases(htable->lock)
+	__releases(RCU_BH)
 {
-	struct xt_bpflimit_htable *htable = PDE_DATA(file_inode(s->file));
 	unsigned int *bucket = v;
 
 	if (!IS_ERR(bucket))
 		kfree(bucket);
-	spin_unlock_bh(&htable->lock);
+	rcu_read_unlock_bh();
 }
 
-static void dl_seq_print(struct dsthash_ent *ent, u_int8_t family,
+static void dl_seq_print(struct dsthash_ent *ent,
+			 const struct xt_bpflimit_htable *ht,
 			 struct seq_file *s)
 {
-	switch (family) {
+	const struct bpflimit_rate *r = dsthash_rate(ht, ent);
+
+	switch (ht->family) {
 	case NFPROTO_IPV4:
-		seq_printf(s, "%ld %pI4:%u->%pI4:%u %llu %llu %llu\n",
-			   (long)(ent->expires - jiffies)/HZ,
+		seq_printf(s, "%ld %pI4:%u->%pI4:%u",
+			   (long)(s32)(ent->expires - bpflimit_stamp)/HZ,
 			   &ent->dst.ip.src,
 			   ntohs(ent->dst.src_port),
 			   &ent->dst.ip.dst,
-			   ntohs(ent->dst.dst_port),
-			   ent->rateinfo.credit, ent->rateinfo.credit_cap,
-			   ent->rateinfo.cost);
+			   ntohs(ent->dst.dst_port));
 		break;
 #if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
 	case NFPROTO_IPV6:
-		seq_printf(s, "%ld %pI6:%u->%pI6:%u %llu %llu %llu\n",
-			   (long)(ent->expires - jiffies)/HZ,
+		seq_printf(s, "%ld %pI6:%u->%pI6:%u",
+			   (long)(s32)(ent->expires - bpflimit_stamp)/HZ,
 			   &ent->dst.ip6.src,
 			   ntohs(ent->dst.src_port),
 			   &ent->dst.ip6.dst,
-			   ntohs(ent->dst.dst_port),
-			   ent->rateinfo.credit, ent->rateinfo.credit_cap,
-			   ent->rateinfo.cost);
+			   ntohs(ent->dst.dst_port));
 		break;
 #endif
 	default:
 		BUG();
 	}
+
+	if (ht->cfg.mode & XT_BPFLIMIT_HASH_BPF)
+		seq_printf(s, "#%x", ent->dst.bpf);
+
+	if (ht->cfg.mode & XT_BPFLIMIT_GCRA) {
+		/* same columns as the token bucket: credit left, cap, cost */
+		u64 now = bpflimit_clock(ht);
+		u64 tat = atomic64_read(&ent->rateinfo.tat);
+		u64 gcra_t = r ? r->gcra_t : ht->rateinfo.gcra_t;
+		u64 cap = (r ? r->gcra_tau : ht->rateinfo.gcra_tau) + gcra_t;
+		u64 debt = (s64)(tat - now) > 0 ? tat - now : 0;
+
+		seq_printf(s, " %llu %llu %llu\n",
+			   debt < cap ? cap - debt : 0, cap, gcra_t);
+		return;
+	}
+
+	if (ht->cfg.mode & XT_BPFLIMIT_RATE_MATCH) {
+		seq_printf(s, " %llu %lld %llu\n",
+			   ent->rateinfo.current_rate, ht->rateinfo.burst,
+			   ht->rateinfo.rate);
+		return;
+	}
+
+	if (dsthash_is_parent(ht, &ent->dst)) {
+		bool bytes = ht->cfg.mode & XT_BPFLIMIT_BYTES;
+
+		seq_printf(s, " %llu %llu %llu\n",
+			   bytes ? div64_u64(ent->rateinfo.credit, NSEC_PER_SEC) :
+			   ent->rateinfo.credit,
+			   bytes ? ht->cfg.parent_burst : ht->parent.credit_cap,
+			   bytes ? ht->cfg.parent_avg : ht->parent.cost);
+		return;
+	}
+
+	if (ht->cfg.mode & XT_BPFLIMIT_BYTES && ht->ns) {
+		/* bytes left, burst and bytes per second */
+		seq_printf(s, " %llu %llu %llu\n",
+			   div64_u64(ent->rateinfo.credit, NSEC_PER_SEC),
+			   r ? r->burst : ht->cfg.burst,
+			   r ? r->avg : ht->cfg.avg);
+		return;
+	}
+
+	if (r) {
+		seq_printf(s, " %llu %llu %llu\n", ent->rateinfo.credit,
+			   r->credit_cap, r->cost);
+		return;
+	}
+
+	seq_printf(s, " %llu %llu %llu\n",
+		   ent->rateinfo.credit,
+		   (ht->cfg.mode & XT_BPFLIMIT_BYTES) ?
+		   (u64)ent->rateinfo.credit_cap : ht->rateinfo.credit_cap,
+		   ht->rateinfo.cost);
 }
 
-static int dl_seq_real_show_v2(struct dsthash_ent *ent, u_int8_t family,
-			       struct seq_file *s)
+static int dl_seq_real_show_v2(struct dsthash_ent *ent, struct seq_file *s)
 {
 	struct xt_bpflimit_htable *ht = PDE_DATA(file_inode(s->file));
 
-	spin_lock(&ent->lock);
+	spin_lock(&ent->rateinfo.lock);
 	/* recalculate to show accurate numbers */
-	rateinfo_recalc(ent, jiffies, ht->cfg.mode, 2);
+	rateinfo_recalc(ent, ht, bpflimit_clock(ht), 2);
 
-	dl_seq_print(ent, family, s);
+	dl_seq_print(ent, ht, s);
 
-	spin_unlock(&ent->lock);
+	spin_unlock(&ent->rateinfo.lock);
 	return seq_has_overflowed(s);
 }
 
-static int dl_seq_real_show_v1(struct dsthash_ent *ent, u_int8_t family,
-			       struct seq_file *s)
+static int dl_seq_real_show_v1(struct dsthash_ent *ent, struct seq_file *s)
 {
 	struct xt_bpflimit_htable *ht = PDE_DATA(file_inode(s->file));
 
-	spin_lock(&ent->lock);
+	spin_lock(&ent->rateinfo.lock);
 	/* recalculate to show accurate numbers */
-	rateinfo_recalc(ent, jiffies, ht->cfg.mode, 1);
+	rateinfo_recalc(ent, ht, bpflimit_clock(ht), 1);
 
-	dl_seq_print(ent, family, s);
+	dl_seq_print(ent, ht, s);
 
-	spin_unlock(&ent->lock);
+	spin_unlock(&ent->rateinfo.lock);
 	return seq_has_overflowed(s);
 }
 
-static int dl_seq_real_show(struct dsthash_ent *ent, u_int8_t family,
-			    struct seq_file *s)
+static int dl_seq_real_show(struct dsthash_ent *ent, struct seq_file *s)
 {
 	struct xt_bpflimit_htable *ht = PDE_DATA(file_inode(s->file));
 
-	spin_lock(&ent->lock);
+	spin_lock(&ent->rateinfo.lock);
 	/* recalculate to show accurate numbers */
-	rateinfo_recalc(ent, jiffies, ht->cfg.mode, 3);
+	rateinfo_recalc(ent, ht, bpflimit_clock(ht), 3);
 
-	dl_seq_print(ent, family, s);
+	dl_seq_print(ent, ht, s);
 
-	spin_unlock(&ent->lock);
+	spin_unlock(&ent->rateinfo.lock);
 	return seq_has_overflowed(s);
 }
 
@@ -1295,11 +3795,12 @@ static int dl_seq_show_v2(struct seq_file *s, void *v)
 {
 	struct xt_bpflimit_htable *htable = PDE_DATA(file_inode(s->file));
 	unsigned int *bucket = (unsigned int *)v;
+	struct hlist_head *head = dl_seq_bucket(htable, *bucket);
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
-			if (dl_seq_real_show_v2(ent, htable->family, s))
+	if (head && !hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
+			if (dl_seq_real_show_v2(ent, s))
 				return -1;
 	}
 	return 0;
@@ -1309,11 +3810,12 @@ static int dl_seq_show_v1(struct seq_file *s, void *v)
 {
 	struct xt_bpflimit_htable *htable = PDE_DATA(file_inode(s->file));
 	unsigned int *bucket = v;
+	struct hlist_head *head = dl_seq_bucket(htable, *bucket);
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
-			if (dl_seq_real_show_v1(ent, htable->family, s))
+	if (head && !hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
+			if (dl_seq_real_show_v1(ent, s))
 				return -1;
 	}
 	return 0;
@@ -1323,12 +3825,25 @@ static int dl_seq_show(struct seq_file *s, void *v)
 {
 	struct xt_bpflimit_htable *htable = PDE_DATA(file_inode(s->file));
 	unsigned int *bucket = v;
+	struct hlist_head *head = dl_seq_bucket(htable, *bucket);
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
-			if (dl_seq_real_show(ent, htable->family, s))
+	/* revision 4 files start with how long gc takes over the table */
+	if (*bucket == 0 && htable->revision >= 4)
+		seq_printf(s, "# gc pass %lluus, max %lluus, %u freed\n",
+			   div_u64(READ_ONCE(htable->wheel.last_ns),
+				   NSEC_PER_USEC),
+			   div_u64(READ_ONCE(htable->wheel.max_ns),
+				   NSEC_PER_USEC),
+			   READ_ONCE(htable->wheel.last_freed));
+
+	if (head && !hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node) {
+			if (dsthash_stale(htable, ent))
+				continue;
+			if (dl_seq_real_show(ent, s))
 				return -1;
+		}
 	}
 	return 0;
 }
@@ -1354,6 +3869,317 @@ static const struct seq_operations dl_seq_ops = {
 	.show  = dl_seq_show
 };
 
+static void bpflimit_rate_init(const struct xt_bpflimit_htable *ht,
+			       struct bpflimit_rate *r, u64 avg, u64 burst)
+{
+	r->avg = avg;
+	r->burst = burst;
+	if (ht->cfg.mode & XT_BPFLIMIT_GCRA) {
+		r->gcra_t = user2ns(avg);
+		r->gcra_tau = r->gcra_t * (burst - 1);
+	} else if (ht->cfg.mode & XT_BPFLIMIT_BYTES) {
+		r->cost = avg;
+		r->credit_cap = burst * NSEC_PER_SEC;
+		r->fill = div64_u64(r->credit_cap + avg - 1, avg);
+	} else {
+		r->cost = user2ns(avg);
+		r->credit_cap = r->cost * burst;
+		r->fill = r->credit_cap;
+	}
+}
+
+/* index + 1 of the rate @avg/@burst, added if the table lacks it */
+static int bpflimit_rate_get(struct xt_bpflimit_htable *ht,
+			     u64 avg, u64 burst)
+{
+	struct bpflimit_rates *old, *new;
+	unsigned int i, n;
+	int id;
+
+	mutex_lock(&ht->rates_lock);
+	old = rcu_dereference_protected(ht->rates,
+					lockdep_is_held(&ht->rates_lock));
+	n = old ? old->n : 0;
+	for (i = 0; i < n; i++) {
+		if (old->r[i].avg == avg && old->r[i].burst == burst) {
+			id = i + 1;
+			goto out;
+		}
+	}
+
+	id = -ENOSPC;
+	if (n == BPFLIMIT_RATES_MAX)
+		goto out;
+
+	id = -ENOMEM;
+	new = kmalloc(sizeof(*new) + (n + 1) * sizeof(new->r[0]),
+		      GFP_KERNEL);
+	if (new == NULL)
+		goto out;
+	if (n)
+		memcpy(new->r, old->r, n * sizeof(new->r[0]));
+	bpflimit_rate_init(ht, &new->r[n], avg, burst);
+	new->n = n + 1;
+
+	/* entries only ever get an index after it is published */
+	rcu_assign_pointer(ht->rates, new);
+	if (old)
+		kfree_rcu(old, rcu);
+	id = n + 1;
+out:
+	mutex_unlock(&ht->rates_lock);
+	return id;
+}
+
+/* Pin @dst to rate @id, or unpin it for 0.  This runs under the stripe
+ * lock, so gc either freed the entry before we looked or finds it
+ * pinned.  A pinned key starts with a full burst; an unpinned one keeps
+ * what it has up to the table's burst and expires as usual.
+ */
+static bool dsthash_pin(struct xt_bpflimit_htable *ht,
+			const struct dsthash_dst *dst, u_int32_t hash,
+			u32 id, u64 now)
+{
+	spinlock_t *lock = dsthash_lock(ht, hash);
+	struct dsthash_table *t, *future;
+	const struct bpflimit_rate *r;
+	struct dsthash_ent *ent;
+
+	spin_lock(lock);
+	future = rcu_dereference_bh(ht->future);
+	smp_rmb();
+	t = rcu_dereference_bh(ht->table);
+	ent = dsthash_find(ht, t, dst, hash);
+	if (ent == NULL && future != NULL)
+		ent = dsthash_find(ht, future, dst, hash);
+	if (ent == NULL) {
+		spin_unlock(lock);
+		return false;
+	}
+
+	spin_lock(&ent->rateinfo.lock);
+	rateinfo_recalc(ent, ht, now, 4);
+	smp_store_release(&ent->rateinfo.rate_id, id);
+	r = dsthash_rate(ht, ent);
+	if (ht->cfg.mode & XT_BPFLIMIT_GCRA) {
+		if (r)
+			atomic64_set(&ent->rateinfo.tat, now);
+	} else if (r) {
+		ent->rateinfo.credit = r->credit_cap;
+	} else {
+		ent->rateinfo.credit = min(ent->rateinfo.credit,
+					   ht->rateinfo.credit_cap);
+	}
+	spin_unlock(&ent->rateinfo.lock);
+
+	WRITE_ONCE(ent->expires,
+		   bpflimit_stamp + msecs_to_jiffies(ht->cfg.expire));
+	if (id == 0)
+		wheel_mark(ht, hash, ent->expires);
+	spin_unlock(lock);
+	return true;
+}
+
+static int dl_parse_field(const struct xt_bpflimit_htable *ht,
+			  struct dsthash_dst *dst, u64 *avg, u64 *burst,
+			  const char *key, const char *val)
+{
+	u32 mode = ht->cfg.mode;
+	u16 port;
+	int ret;
+
+	if (!strcmp(key, "avg"))
+		return kstrtou64(val, 0, avg);
+	if (!strcmp(key, "burst"))
+		return kstrtou64(val, 0, burst);
+
+	if (!strcmp(key, "sport") || !strcmp(key, "dport")) {
+		bool src = key[0] == 's';
+
+		if (!(mode & (src ? XT_BPFLIMIT_HASH_SPT :
+				    XT_BPFLIMIT_HASH_DPT)))
+			return -EINVAL;
+		ret = kstrtou16(val, 0, &port);
+		if (ret)
+			return ret;
+		if (src)
+			dst->src_port = htons(port);
+		else
+			dst->dst_port = htons(port);
+		return 0;
+	}
+
+	if (!strcmp(key, "bpf")) {
+		if (!(mode & XT_BPFLIMIT_HASH_BPF))
+			return -EINVAL;
+		return kstrtou32(val, 0, &dst->bpf);
+	}
+
+	if (!strcmp(key, "src") || !strcmp(key, "dst")) {
+		bool src = key[0] == 's';
+
+		if (!(mode & (src ? XT_BPFLIMIT_HASH_SIP :
+				    XT_BPFLIMIT_HASH_DIP)))
+			return -EINVAL;
+
+		switch (ht->family) {
+		case NFPROTO_IPV4: {
+			__be32 *a = src ? &dst->ip.src : &dst->ip.dst;
+
+			if (!in4_pton(val, -1, (u8 *)a, -1, NULL))
+				return -EINVAL;
+			*a = maskl(*a, src ? ht->cfg.srcmask : ht->cfg.dstmask);
+			return 0;
+		}
+#if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
+		case NFPROTO_IPV6: {
+			__be32 *a = src ? dst->ip6.src : dst->ip6.dst;
+
+			if (!in6_pton(val, -1, (u8 *)a, -1, NULL))
+				return -EINVAL;
+			bpflimit_ipv6_mask(a, src ? ht->cfg.srcmask :
+						    ht->cfg.dstmask);
+			return 0;
+		}
+#endif
+		}
+	}
+	return -EINVAL;
+}
+
+/* Forget every key at once.  Entries are not touched here, only the
+ * generation is bumped and the wheel told to look at every chunk on
+ * its next slot, so this costs the same for any table size.  The
+ * admission sketch starts over too, or flushed keys would be admitted
+ * on what they sent before.
+ */
+static void htable_flush(struct xt_bpflimit_htable *ht)
+{
+	WRITE_ONCE(ht->gen, ht->gen + 1);
+	if (ht->cms)
+		cms_clear(ht);
+	/* racing with gc on the bits is fine, they are only hints */
+	bitmap_fill(wheel_slot(ht, READ_ONCE(ht->wheel.done) + 1),
+		    ht->wheel.chunks);
+}
+
+/* Keys are pinned to their own rate by writing to the table's file:
+ *
+ *   pin [src=ADDR] [dst=ADDR] [sport=N] [dport=N] [bpf=N] avg=N burst=N
+ *   unpin [src=ADDR] [dst=ADDR] [sport=N] [dport=N] [bpf=N]
+ *
+ * The key takes the fields of the mode, addresses are masked like the
+ * packet's.  avg and burst are raw values in the units of cfg: avg is
+ * the interval between packets in 1/XT_BPFLIMIT_SCALE_v4 s (ns) and
+ * burst a packet count, or bytes per second and bytes in byte mode.
+ * So 1000/sec with a burst of 5 is "avg=1000000 burst=5".  A pinned key
+ * is served by the same lookup as any other, but never expires or gets
+ * evicted.  Revision 4 token buckets and GCRA only.
+ *
+ *   flush
+ *
+ * resets every key of a revision 4 table but the pinned ones, which
+ * keep their rate and state.  The table-wide global limit is not a
+ * key and is left alone.
+ *
+ * The file is 0644 like any proc file.  Whoever opened it for writing
+ * needs CAP_NET_ADMIN in the table's namespace, as for sysctls.
+ */
+#define BPFLIMIT_CMD_MAX 256
+
+static ssize_t dl_proc_write(struct file *file, const char __user *input,
+			     size_t size, loff_t *loff)
+{
+	struct xt_bpflimit_htable *ht = PDE_DATA(file_inode(file));
+	char buf[BPFLIMIT_CMD_MAX], *p, *tok;
+	struct dsthash_dst dst;
+	u64 avg = 0, burst = 0;
+	u_int32_t hash;
+	int ret, id = 0;
+	bool pin;
+	u64 now;
+
+	if (!file_ns_capable(file, ht->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+	if (size >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, input, size))
+		return -EFAULT;
+	buf[size] = '\0';
+
+	p = strim(buf);
+	tok = strsep(&p, " ");
+	if (!strcmp(tok, "flush")) {
+		if (p != NULL)
+			return -EINVAL;
+		/* a sketch has no entries to flush */
+		if (ht->revision < 4 || ht->cells)
+			return -EOPNOTSUPP;
+		htable_flush(ht);
+		return size;
+	}
+
+	if (!bpflimit_can_pin(ht))
+		return -EOPNOTSUPP;
+	if (!strcmp(tok, "pin"))
+		pin = true;
+	else if (!strcmp(tok, "unpin"))
+		pin = false;
+	else
+		return -EINVAL;
+
+	memset(&dst, 0, sizeof(dst));
+	while ((tok = strsep(&p, " ")) != NULL) {
+		char *val;
+
+		if (*tok == '\0')
+			continue;
+		val = strchr(tok, '=');
+		if (val == NULL)
+			return -EINVAL;
+		*val++ = '\0';
+		ret = dl_parse_field(ht, &dst, &avg, &burst, tok, val);
+		if (ret)
+			return ret;
+	}
+
+	if (pin) {
+		if (!bpflimit_rate_fits(ht->cfg.mode, avg, burst))
+			return -ERANGE;
+		id = bpflimit_rate_get(ht, avg, burst);
+		if (id < 0)
+			return id;
+	}
+
+	rcu_read_lock_bh();
+	hash = hash_key(ht, &dst);
+	now = bpflimit_clock(ht);
+	ret = 0;
+	while (!dsthash_pin(ht, &dst, hash, id, now)) {
+		struct dsthash_ent *parent = NULL;
+
+		/* nothing to unpin */
+		if (!pin)
+			break;
+
+		if (ht->cfg.mode & XT_BPFLIMIT_PARENT) {
+			parent = dsthash_parent_get(ht, &dst, now);
+			if (parent == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		if (dsthash_alloc_init(ht, &dst, hash, now, 0, parent,
+				       4) == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	rcu_read_unlock_bh();
+
+	return ret ? ret : size;
+}
+
 static int __net_init bpflimit_proc_net_init(struct net *net)
 {
 	struct bpflimit_net *bpflimit_net = bpflimit_pernet(net);
@@ -1398,11 +4224,16 @@ static int __net_init bpflimit_net_init(struct net *net)
 	struct bpflimit_net *bpflimit_net = bpflimit_pernet(net);
 
 	INIT_HLIST_HEAD(&bpflimit_net->htables);
+	INIT_DEFERRABLE_WORK(&bpflimit_net->gc_work, bpflimit_gc_work);
 	return bpflimit_proc_net_init(net);
 }
 
 static void __net_exit bpflimit_net_exit(struct net *net)
 {
+	struct bpflimit_net *bpflimit_net = bpflimit_pernet(net);
+
+	/* tables left over are about to go, they need no more gc */
+	cancel_delayed_work_sync(&bpflimit_net->gc_work);
 	bpflimit_proc_net_exit(net);
 }
 
@@ -1427,7 +4258,8 @@ static int __init bpflimit_mt_init(void)
 
 	err = -ENOMEM;
 	bpflimit_cachep = kmem_cache_create("xt_bpflimit",
-					    sizeof(struct dsthash_ent), 0, 0,
+					    sizeof(struct dsthash_ent), 0,
+					    SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT,
 					    NULL);
 	if (!bpflimit_cachep) {
 		pr_warn("unable to create slab cache\n");
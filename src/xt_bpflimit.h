@@ -13,12 +13,21 @@
 /* timings are in milliseconds. */
 #define XT_BPFLIMIT_SCALE 10000
 #define XT_BPFLIMIT_SCALE_v2 1000000llu
+/* revision 4 counts nanoseconds, up to 10^9/sec */
+#define XT_BPFLIMIT_SCALE_v4 1000000000llu
 /* 1/10,000 sec period => max of 10,000/sec.  Min rate is then 429490
  * seconds, or one packet every 59 hours.
  */
  
 /* packet length accounting is done in 16-byte steps */
 #define XT_BPFLIMIT_BYTE_SHIFT 4
+/* revision 4 keeps byte credits in byte-nanoseconds, so a byte burst
+ * is at most S64_MAX/2/10^9 bytes, about 4.6GB
+ */
+#define XT_BPFLIMIT_BYTE_BURST_MAX_v4 4611686018llu
+
+/* maximum length of a pinned eBPF program path in bpffs */
+#define XT_BPFLIMIT_PATH_MAX 512
 
 /* details of this structure hidden by the implementation */
 struct xt_bpflimit_htable;
@@ -31,6 +40,14 @@ enum {
 	XT_BPFLIMIT_INVERT		= 1 << 4,
 	XT_BPFLIMIT_BYTES		= 1 << 5,
 	XT_BPFLIMIT_RATE_MATCH		= 1 << 6,
+	XT_BPFLIMIT_HASH_BPF		= 1 << 7,
+	XT_BPFLIMIT_GCRA		= 1 << 8,
+	XT_BPFLIMIT_EVICT		= 1 << 9,
+	XT_BPFLIMIT_PREALLOC		= 1 << 10,
+	XT_BPFLIMIT_SKETCH		= 1 << 11,
+	XT_BPFLIMIT_PARENT		= 1 << 12,
+	XT_BPFLIMIT_GLOBAL		= 1 << 13,
+	XT_BPFLIMIT_SHRINK		= 1 << 14,
 };
 
 struct bpflimit_cfg {
@@ -101,6 +118,39 @@ struct bpflimit_cfg3 {
 	__u8 srcmask, dstmask;
 };
 
+struct bpflimit_cfg4 {
+	/* ordered by size with explicit padding, so the layout is the
+	 * same for 32 bit userspace on a 64 bit kernel */
+	__u64 avg;		/* ns between packets, or bytes per second */
+	__u64 burst;		/* packets, or bytes in byte mode */
+
+	/* aggregate limit over the keys, XT_BPFLIMIT_PARENT */
+	__u64 parent_avg;	/* same units as avg */
+	__u64 parent_burst;
+
+	/* ceiling over the whole table, XT_BPFLIMIT_GLOBAL */
+	__u64 global_avg;	/* same units as avg */
+	__u64 global_burst;
+
+	__u64 maxmem;		/* bytes of entries and buckets, 0 for no cap */
+
+	__u32 mode;		/* bitmask of XT_BPFLIMIT_HASH_* */
+
+	/* user specified */
+	__u32 size;		/* how many buckets */
+	__u32 max;		/* max number of entries */
+	__u32 gc_interval;	/* gc interval */
+	__u32 expire;		/* when do entries expire? */
+
+	__u32 interval;		/* rate match window, ms */
+	__u32 admit;		/* packets seen before a key gets an entry */
+	__u32 probation;	/* ms a new entry lives until its second packet */
+
+	__u8 srcmask, dstmask;
+	__u8 parent_srcmask, parent_dstmask;	/* XT_BPFLIMIT_PARENT */
+	__u8 pad[4];
+};
+
 struct xt_bpflimit_mtinfo1 {
 	char name[IFNAMSIZ];
 	struct bpflimit_cfg1 cfg;
@@ -125,10 +175,23 @@ struct xt_bpflimit_mtinfo3 {
 	struct xt_bpflimit_htable *hinfo __attribute__((aligned(8)));
 };
 
+struct xt_bpflimit_mtinfo4 {
+	char name[NAME_MAX];
+	struct bpflimit_cfg4 cfg;
+	char bpf_path[XT_BPFLIMIT_PATH_MAX];	/* pinned program, bpffs path */
+
+	/* Used internally by the kernel */
+	struct xt_bpflimit_htable *hinfo __attribute__((aligned(8)));
+};
+
 #endif /* _UAPI_XT_BPFLIMIT_H */
 
 #define XT_BPFLIMIT_ALL (XT_BPFLIMIT_HASH_DIP | XT_BPFLIMIT_HASH_DPT | \
 			  XT_BPFLIMIT_HASH_SIP | XT_BPFLIMIT_HASH_SPT | \
 			  XT_BPFLIMIT_INVERT | XT_BPFLIMIT_BYTES |\
-			  XT_BPFLIMIT_RATE_MATCH)
+			  XT_BPFLIMIT_RATE_MATCH | XT_BPFLIMIT_HASH_BPF |\
+			  XT_BPFLIMIT_GCRA | XT_BPFLIMIT_EVICT |\
+			  XT_BPFLIMIT_PREALLOC | XT_BPFLIMIT_SKETCH |\
+			  XT_BPFLIMIT_PARENT | XT_BPFLIMIT_GLOBAL |\
+			  XT_BPFLIMIT_SHRINK)
 #endif /*_XT_BPFLIMIT_H*/
\ No newline at end of file